@@ -0,0 +1,454 @@
+#define _GNU_SOURCE
+#include "buffered_open.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// Microbenchmarks of buffered_file_t against stdio FILE* and raw read()/write().
+// Every case writes or reads a whole file in operations of one size and reports the
+// time per operation, the throughput and the syscalls per operation.
+//
+// Syscalls are counted by the kernel's raw_syscalls:sys_enter tracepoint when it can be
+// opened (tracefs mounted and perf events allowed), which sees every syscall of the process.
+// Otherwise the read, write, lseek, pread, pwrite and ftruncate calls of the benchmark and
+// the library are counted through the linker's --wrap (see CMakeLists.txt). stdio makes its
+// calls inside libc where no wrapper sees them, so its rows then fall back to the kernel's
+// read and write counts in /proc/self/io, which leave out the lseek calls of fseek.
+
+// Above this file size O_PREAPPEND is skipped, every flush rewrites the whole file
+#define PREAPPEND_MAX_FILE_SIZE (1024 * 1024)
+
+// The API under test
+typedef enum {
+    API_BUFFERED,
+    API_BUFFERED_PREAPPEND,
+    API_STDIO,
+    API_RAW
+} api_t;
+
+// How the operations walk through the file
+typedef enum {
+    PATTERN_SEQUENTIAL,
+    PATTERN_RANDOM
+} pattern_t;
+
+// Measurements of one case
+typedef struct {
+    double seconds;
+    unsigned long long operations;
+    unsigned long long bytes;
+    unsigned long long syscalls;
+} result_t;
+
+static const char *api_names[] = {"buffered", "buffered+preappend", "stdio", "raw"};
+static const char *pattern_names[] = {"seq", "random"};
+
+// Read the monotonic clock in seconds
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Descriptor of the tracepoint counter, -1 when the wrapped calls are counted instead
+static int syscall_counter = -1;
+
+// File I/O calls of the benchmark and the library, counted by the wrappers below
+static unsigned long long wrapped_calls;
+
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+off_t __real_lseek(int fd, off_t offset, int whence);
+ssize_t __real_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t __real_pwrite(int fd, const void *buf, size_t count, off_t offset);
+int __real_ftruncate(int fd, off_t length);
+
+ssize_t __wrap_read(int fd, void *buf, size_t count) {
+    wrapped_calls++;
+    return __real_read(fd, buf, count);
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t count) {
+    wrapped_calls++;
+    return __real_write(fd, buf, count);
+}
+
+off_t __wrap_lseek(int fd, off_t offset, int whence) {
+    wrapped_calls++;
+    return __real_lseek(fd, offset, whence);
+}
+
+ssize_t __wrap_pread(int fd, void *buf, size_t count, off_t offset) {
+    wrapped_calls++;
+    return __real_pread(fd, buf, count, offset);
+}
+
+ssize_t __wrap_pwrite(int fd, const void *buf, size_t count, off_t offset) {
+    wrapped_calls++;
+    return __real_pwrite(fd, buf, count, offset);
+}
+
+int __wrap_ftruncate(int fd, off_t length) {
+    wrapped_calls++;
+    return __real_ftruncate(fd, length);
+}
+
+// Open a counter of every syscall this process enters, -1 if the kernel does not offer one
+static int open_syscall_counter(void) {
+    static const char *id_paths[] = {
+        "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+        "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+    };
+
+    for (size_t i = 0; i < sizeof(id_paths) / sizeof(id_paths[0]); i++) {
+        FILE *file = fopen(id_paths[i], "r");
+        if (!file) {
+            continue;
+        }
+        unsigned long long id;
+        int found = fscanf(file, "%llu", &id) == 1;
+        fclose(file);
+        if (!found) {
+            continue;
+        }
+
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_TRACEPOINT;
+        attr.size = sizeof(attr);
+        attr.config = id;
+        int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fd != -1) {
+            return fd;
+        }
+    }
+    return -1;
+}
+
+// Read the kernel's count of read and write syscalls this process has made so far
+static unsigned long long kernel_io_count(void) {
+    FILE *file = fopen("/proc/self/io", "r");
+    if (!file) {
+        return 0;
+    }
+
+    char line[128];
+    unsigned long long value;
+    unsigned long long total = 0;
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "syscr: %llu", &value) == 1 || sscanf(line, "syscw: %llu", &value) == 1) {
+            total += value;
+        }
+    }
+    fclose(file);
+    return total;
+}
+
+// Count the syscalls this process has made so far, the way the API under test can be counted
+static unsigned long long syscall_count(api_t api) {
+    if (syscall_counter != -1) {
+        // The read of the counter enters the kernel too, it is the same in every difference
+        unsigned long long value = 0;
+        if (read(syscall_counter, &value, sizeof(value)) != sizeof(value)) {
+            return 0;
+        }
+        return value;
+    }
+    return api == API_STDIO ? kernel_io_count() : wrapped_calls;
+}
+
+// Pick the offset of the next operation, random offsets stay aligned to the operation size
+static off_t next_offset(pattern_t pattern, unsigned long long op, size_t io_size, size_t file_size) {
+    if (pattern == PATTERN_SEQUENTIAL) {
+        return (off_t)(op * io_size);
+    }
+    size_t slots = file_size / io_size;
+    return (off_t)((size_t)rand() % slots * io_size);
+}
+
+// Write file_size bytes in io_size operations
+static int run_write(api_t api, pattern_t pattern, const char *path, size_t io_size, size_t file_size,
+                     const char *data, result_t *result) {
+    unsigned long long ops = file_size / io_size;
+    unsigned long long before = syscall_count(api);
+    double start = now_seconds();
+
+    if (api == API_BUFFERED || api == API_BUFFERED_PREAPPEND) {
+        // Prepending reads the existing content back, so it needs read access
+        int flags = api == API_BUFFERED_PREAPPEND ? (O_RDWR | O_PREAPPEND) : O_WRONLY;
+        flags |= O_CREAT | O_TRUNC;
+        buffered_file_t *bf = buffered_open(path, flags, 0644);
+        if (!bf) {
+            return -1;
+        }
+        for (unsigned long long op = 0; op < ops; op++) {
+            if (pattern == PATTERN_RANDOM) {
+                // The seek flushes first, the buffer only covers one contiguous run
+                if (buffered_seek(bf, next_offset(pattern, op, io_size, file_size), SEEK_SET) == -1) {
+                    buffered_close(bf);
+                    return -1;
+                }
+            }
+            if (buffered_write(bf, data, io_size) == -1) {
+                buffered_close(bf);
+                return -1;
+            }
+        }
+        if (buffered_close(bf) == -1) {
+            return -1;
+        }
+    } else if (api == API_STDIO) {
+        FILE *file = fopen(path, "w");
+        if (!file) {
+            perror("fopen");
+            return -1;
+        }
+        for (unsigned long long op = 0; op < ops; op++) {
+            if (pattern == PATTERN_RANDOM) {
+                fseeko(file, next_offset(pattern, op, io_size, file_size), SEEK_SET);
+            }
+            if (fwrite(data, 1, io_size, file) != io_size) {
+                perror("fwrite");
+                fclose(file);
+                return -1;
+            }
+        }
+        if (fclose(file) == EOF) {
+            perror("fclose");
+            return -1;
+        }
+    } else {
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            perror("open");
+            return -1;
+        }
+        for (unsigned long long op = 0; op < ops; op++) {
+            if (pattern == PATTERN_RANDOM) {
+                lseek(fd, next_offset(pattern, op, io_size, file_size), SEEK_SET);
+            }
+            if (write(fd, data, io_size) != (ssize_t)io_size) {
+                perror("write");
+                close(fd);
+                return -1;
+            }
+        }
+        close(fd);
+    }
+
+    result->seconds = now_seconds() - start;
+    result->syscalls = syscall_count(api) - before;
+    result->operations = ops;
+    result->bytes = ops * io_size;
+    return 0;
+}
+
+// Read file_size bytes in io_size operations from a file written beforehand
+static int run_read(api_t api, pattern_t pattern, const char *path, size_t io_size, size_t file_size,
+                    char *buf, result_t *result) {
+    unsigned long long ops = file_size / io_size;
+    unsigned long long before = syscall_count(api);
+    double start = now_seconds();
+
+    if (api == API_BUFFERED) {
+        buffered_file_t *bf = buffered_open(path, O_RDONLY);
+        if (!bf) {
+            return -1;
+        }
+        for (unsigned long long op = 0; op < ops; op++) {
+            if (pattern == PATTERN_RANDOM
+                && buffered_seek(bf, next_offset(pattern, op, io_size, file_size), SEEK_SET) == -1) {
+                buffered_close(bf);
+                return -1;
+            }
+            if (buffered_read(bf, buf, io_size) == -1) {
+                buffered_close(bf);
+                return -1;
+            }
+        }
+        buffered_close(bf);
+    } else if (api == API_STDIO) {
+        FILE *file = fopen(path, "r");
+        if (!file) {
+            perror("fopen");
+            return -1;
+        }
+        for (unsigned long long op = 0; op < ops; op++) {
+            if (pattern == PATTERN_RANDOM) {
+                fseeko(file, next_offset(pattern, op, io_size, file_size), SEEK_SET);
+            }
+            if (fread(buf, 1, io_size, file) != io_size) {
+                perror("fread");
+                fclose(file);
+                return -1;
+            }
+        }
+        fclose(file);
+    } else {
+        int fd = open(path, O_RDONLY);
+        if (fd == -1) {
+            perror("open");
+            return -1;
+        }
+        for (unsigned long long op = 0; op < ops; op++) {
+            if (pattern == PATTERN_RANDOM) {
+                lseek(fd, next_offset(pattern, op, io_size, file_size), SEEK_SET);
+            }
+            if (read(fd, buf, io_size) != (ssize_t)io_size) {
+                perror("read");
+                close(fd);
+                return -1;
+            }
+        }
+        close(fd);
+    }
+
+    result->seconds = now_seconds() - start;
+    result->syscalls = syscall_count(api) - before;
+    result->operations = ops;
+    result->bytes = ops * io_size;
+    return 0;
+}
+
+// Print one result row
+static void report(const char *op, api_t api, pattern_t pattern, size_t io_size, size_t file_size,
+                   const result_t *result) {
+    double ns_per_op = result->operations ? result->seconds * 1e9 / result->operations : 0;
+    double mb_per_s = result->seconds > 0 ? result->bytes / (1024.0 * 1024.0) / result->seconds : 0;
+    double syscalls_per_op = result->operations ? (double)result->syscalls / result->operations : 0;
+    printf("%-6s %-19s %-7s %8zu %10zu %12.1f %10.1f %10.4f\n",
+           op, api_names[api], pattern_names[pattern], io_size, file_size, ns_per_op, mb_per_s, syscalls_per_op);
+}
+
+// Parse a comma-separated list of sizes with an optional K or M suffix
+static int parse_sizes(const char *text, size_t *sizes, int max) {
+    int count = 0;
+    char *copy = strdup(text);
+    if (!copy) {
+        return 0;
+    }
+
+    for (char *token = strtok(copy, ","); token && count < max; token = strtok(NULL, ",")) {
+        char *end;
+        size_t value = strtoull(token, &end, 10);
+        if (*end == 'K' || *end == 'k') {
+            value *= 1024;
+        } else if (*end == 'M' || *end == 'm') {
+            value *= 1024 * 1024;
+        }
+        if (value > 0) {
+            sizes[count++] = value;
+        }
+    }
+
+    free(copy);
+    return count;
+}
+
+static void print_usage(const char *prog_name) {
+    fprintf(stderr, "Usage: %s [-w io_sizes] [-s file_sizes] [-f path]\n", prog_name);
+    fprintf(stderr, "  -w: Operation sizes, default 16,64,256,1K,4K,16K\n");
+    fprintf(stderr, "  -s: File sizes, default 1M,16M\n");
+    fprintf(stderr, "  -f: Scratch file, default bench_buffered.dat\n");
+}
+
+int main(int argc, char *argv[]) {
+    size_t io_sizes[16] = {16, 64, 256, 1024, 4096, 16384};
+    size_t file_sizes[16] = {1024 * 1024, 16 * 1024 * 1024};
+    int io_count = 6;
+    int file_count = 2;
+    const char *path = "bench_buffered.dat";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "w:s:f:")) != -1) {
+        switch (opt) {
+            case 'w':
+                io_count = parse_sizes(optarg, io_sizes, 16);
+                break;
+            case 's':
+                file_count = parse_sizes(optarg, file_sizes, 16);
+                break;
+            case 'f':
+                path = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (io_count == 0 || file_count == 0) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Room for the largest operation plus the terminator buffered_read writes after the data
+    size_t largest = 0;
+    for (int i = 0; i < io_count; i++) {
+        largest = io_sizes[i] > largest ? io_sizes[i] : largest;
+    }
+    char *data = malloc(largest + 1);
+    char *buf = malloc(largest + 1);
+    if (!data || !buf) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    memset(data, 'x', largest);
+
+    syscall_counter = open_syscall_counter();
+    printf("Syscalls counted by %s\n", syscall_counter != -1 ? "the raw_syscalls:sys_enter tracepoint"
+                                                             : "wrappers, stdio by /proc/self/io reads and writes");
+
+    printf("%-6s %-19s %-7s %8s %10s %12s %10s %10s\n",
+           "op", "api", "pattern", "io_size", "file_size", "ns/op", "MB/s", "syscalls/op");
+
+    result_t result;
+    for (int f = 0; f < file_count; f++) {
+        for (int w = 0; w < io_count; w++) {
+            size_t io_size = io_sizes[w];
+            size_t file_size = file_sizes[f];
+            if (io_size > file_size) {
+                continue;
+            }
+
+            for (int pattern = PATTERN_SEQUENTIAL; pattern <= PATTERN_RANDOM; pattern++) {
+                for (int api = API_BUFFERED; api <= API_RAW; api++) {
+                    // Prepending is only meaningful sequentially and gets quadratic on large files
+                    if (api == API_BUFFERED_PREAPPEND
+                        && (pattern != PATTERN_SEQUENTIAL || file_size > PREAPPEND_MAX_FILE_SIZE)) {
+                        continue;
+                    }
+                    srand(1);
+                    if (run_write(api, pattern, path, io_size, file_size, data, &result) == -1) {
+                        return EXIT_FAILURE;
+                    }
+                    report("write", api, pattern, io_size, file_size, &result);
+                }
+
+                // Reads run against a fully written file, the page cache is warm for all of them
+                srand(1);
+                if (run_write(API_RAW, PATTERN_SEQUENTIAL, path, io_size, file_size, data, &result) == -1) {
+                    return EXIT_FAILURE;
+                }
+                for (int api = API_BUFFERED; api <= API_RAW; api++) {
+                    if (api == API_BUFFERED_PREAPPEND) {
+                        continue;
+                    }
+                    srand(1);
+                    if (run_read(api, pattern, path, io_size, file_size, buf, &result) == -1) {
+                        return EXIT_FAILURE;
+                    }
+                    report("read", api, pattern, io_size, file_size, &result);
+                }
+            }
+        }
+    }
+
+    unlink(path);
+    free(data);
+    free(buf);
+    return 0;
+}
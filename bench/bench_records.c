@@ -0,0 +1,185 @@
+#define _GNU_SOURCE
+#include "buffered_open.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Throughput of line scanning: getline() on a FILE* against buffered_getdelim and buffered_next_record.
+// Point it at a real multi-GB log file, or let it generate a synthetic one first with -g.
+
+// Result of one pass over the file
+typedef struct {
+    unsigned long long records;
+    unsigned long long bytes;
+    double seconds;
+} pass_result_t;
+
+// Read the monotonic clock in seconds
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Write a synthetic log of roughly size_mb MiB with lines of varying length
+static int generate_log(const char *path, unsigned long long size_mb) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        perror("fopen");
+        return -1;
+    }
+
+    unsigned long long target = size_mb * 1024 * 1024;
+    unsigned long long written = 0;
+    unsigned long long line = 0;
+    const char *levels[] = {"INFO", "WARN", "DEBUG", "ERROR"};
+    while (written < target) {
+        int padding = (int)(line * 7919 % 160);
+        int n = fprintf(file, "2024-01-01T00:00:%02llu.%06llu %-5s worker-%llu request=%llu %.*s\n",
+                        line % 60, line % 1000000, levels[line % 4], line % 32, line, padding,
+                        "................................................................................"
+                        "................................................................................");
+        if (n < 0) {
+            perror("fprintf");
+            fclose(file);
+            return -1;
+        }
+        written += n;
+        line++;
+    }
+
+    if (fclose(file) == EOF) {
+        perror("fclose");
+        return -1;
+    }
+    return 0;
+}
+
+// Scan the file with stdio getline()
+static int run_getline(const char *path, int delim, pass_result_t *result) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror("fopen");
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t n;
+    memset(result, 0, sizeof(*result));
+    double start = now_seconds();
+    while ((n = getdelim(&line, &capacity, delim, file)) != -1) {
+        result->records++;
+        result->bytes += n;
+    }
+    result->seconds = now_seconds() - start;
+
+    free(line);
+    fclose(file);
+    return 0;
+}
+
+// Scan the file with buffered_getdelim, which copies every record out
+static int run_getdelim(const char *path, int delim, pass_result_t *result) {
+    buffered_file_t *bf = buffered_open(path, O_RDONLY);
+    if (!bf) {
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t n;
+    memset(result, 0, sizeof(*result));
+    double start = now_seconds();
+    while ((n = buffered_getdelim(bf, &line, &capacity, delim)) != -1) {
+        result->records++;
+        result->bytes += n;
+    }
+    result->seconds = now_seconds() - start;
+
+    free(line);
+    buffered_close(bf);
+    return 0;
+}
+
+// Scan the file with buffered_next_record, which hands out views into the read buffer
+static int run_next_record(const char *path, int delim, pass_result_t *result) {
+    buffered_file_t *bf = buffered_open(path, O_RDONLY);
+    if (!bf) {
+        return -1;
+    }
+
+    const char *record;
+    ssize_t n;
+    memset(result, 0, sizeof(*result));
+    double start = now_seconds();
+    while ((n = buffered_next_record(bf, delim, &record)) > 0) {
+        result->records++;
+        result->bytes += n;
+    }
+    result->seconds = now_seconds() - start;
+
+    buffered_close(bf);
+    return n == -1 ? -1 : 0;
+}
+
+// Print one result line
+static void report(const char *name, const pass_result_t *result) {
+    double mb = result->bytes / (1024.0 * 1024.0);
+    printf("%-22s %12llu records %10.1f MiB %8.3f s %10.1f MiB/s\n",
+           name, result->records, mb, result->seconds, result->seconds > 0 ? mb / result->seconds : 0.0);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    unsigned long long generate_mb = 0;
+    int delim = '\n';
+
+    while ((opt = getopt(argc, argv, "g:d:")) != -1) {
+        switch (opt) {
+            case 'g':
+                generate_mb = strtoull(optarg, NULL, 10);
+                break;
+            case 'd':
+                delim = (unsigned char)optarg[0];
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-g size_mb] [-d delimiter] <file>\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind + 1 != argc) {
+        fprintf(stderr, "Usage: %s [-g size_mb] [-d delimiter] <file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *path = argv[optind];
+
+    if (generate_mb > 0 && generate_log(path, generate_mb) == -1) {
+        return EXIT_FAILURE;
+    }
+
+    // Warm the page cache so every contender reads from memory
+    pass_result_t result;
+    if (run_getline(path, delim, &result) == -1) {
+        return EXIT_FAILURE;
+    }
+
+    if (run_getline(path, delim, &result) == -1) {
+        return EXIT_FAILURE;
+    }
+    report("getline", &result);
+
+    if (run_getdelim(path, delim, &result) == -1) {
+        return EXIT_FAILURE;
+    }
+    report("buffered_getdelim", &result);
+
+    if (run_next_record(path, delim, &result) == -1) {
+        return EXIT_FAILURE;
+    }
+    report("buffered_next_record", &result);
+
+    return 0;
+}
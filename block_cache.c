@@ -0,0 +1,423 @@
+#include "block_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// The cache only sees writes made through buffered_file_t in this process.
+// Data changed by other processes or by plain write() on the same file is not noticed while
+// the file is open, but a file whose size or times changed is dropped when it is opened again.
+
+// One cached block of a file
+typedef struct cache_block {
+    block_cache_file_t *file;       // File the block belongs to
+    uint64_t index;                 // Block number inside the file
+    size_t length;                  // Valid bytes, less than a block only at end of file
+    int in_use;                     // Whether the slot holds a block that is linked into the hash table
+    int referenced;                 // CLOCK bit, set on every access and cleared when the hand passes
+    struct cache_block *next;       // Next block in the same hash bucket
+    struct cache_block *file_next;  // Next block of the same file in the same shard
+    struct cache_block *file_prev;  // Previous block of the same file in the same shard, NULL for the first
+    char data[BLOCK_CACHE_BLOCK_SIZE];
+} cache_block_t;
+
+// An independently locked part of the cache with its own budget
+typedef struct {
+    pthread_mutex_t lock;
+
+    cache_block_t **buckets;        // Hash chains
+    size_t bucket_count;
+
+    cache_block_t *blocks;          // Block slots, swept in order by the CLOCK hand
+    size_t capacity;                // Number of slots
+    size_t used;                    // Slots handed out at least once
+    size_t hand;                    // Next slot the CLOCK hand looks at
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+    uint64_t blocks_cached;
+} cache_shard_t;
+
+// A file opened through the cache, kept until the cache is turned off so blocks can point to it
+struct block_cache_file {
+    // What the cache saw of the file when it was last opened, under files_lock
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+
+    // Blocks of the file in each shard, each list under the lock of its shard
+    cache_block_t *blocks[BLOCK_CACHE_SHARDS];
+};
+
+static cache_shard_t *shards;
+
+// Open-addressing table of every file opened through the cache, under its own lock
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+static block_cache_file_t **files;
+static size_t file_capacity;
+static size_t file_count;
+
+// Mix a key and a block number into a hash
+static uint64_t hash_key(uint64_t first, uint64_t second, uint64_t index) {
+    uint64_t hash = first * 0x9E3779B97F4A7C15ULL;
+    hash ^= second + 0x9E3779B97F4A7C15ULL + (hash << 6) + (hash >> 2);
+    hash ^= index + 0x9E3779B97F4A7C15ULL + (hash << 6) + (hash >> 2);
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// Pick the shard and bucket for a block
+static cache_shard_t *shard_for(const block_cache_file_t *file, uint64_t index, cache_block_t ***bucket) {
+    uint64_t hash = hash_key((uintptr_t)file, 0, index);
+    cache_shard_t *shard = &shards[hash % BLOCK_CACHE_SHARDS];
+    *bucket = &shard->buckets[(hash / BLOCK_CACHE_SHARDS) % shard->bucket_count];
+    return shard;
+}
+
+// Find a block in a bucket, the shard lock must be held
+static cache_block_t *find_block(cache_block_t **bucket, const block_cache_file_t *file, uint64_t index) {
+    for (cache_block_t *block = *bucket; block; block = block->next) {
+        if (block->index == index && block->file == file) {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+// Put a filled block into its hash chain and its file's list, the shard lock must be held
+static void link_block(cache_shard_t *shard, cache_block_t **bucket, cache_block_t *block) {
+    block->in_use = 1;
+    block->next = *bucket;
+    *bucket = block;
+
+    cache_block_t **first = &block->file->blocks[shard - shards];
+    block->file_prev = NULL;
+    block->file_next = *first;
+    if (*first) {
+        (*first)->file_prev = block;
+    }
+    *first = block;
+    shard->blocks_cached++;
+}
+
+// Remove a block from its hash chain and its file's list and free its slot, the shard lock must be held
+static void unlink_block(cache_shard_t *shard, cache_block_t *block) {
+    uint64_t hash = hash_key((uintptr_t)block->file, 0, block->index);
+    cache_block_t **link = &shard->buckets[(hash / BLOCK_CACHE_SHARDS) % shard->bucket_count];
+    while (*link != block) {
+        link = &(*link)->next;
+    }
+    *link = block->next;
+
+    if (block->file_prev) {
+        block->file_prev->file_next = block->file_next;
+    } else {
+        block->file->blocks[shard - shards] = block->file_next;
+    }
+    if (block->file_next) {
+        block->file_next->file_prev = block->file_prev;
+    }
+
+    block->in_use = 0;
+    shard->blocks_cached--;
+}
+
+// Get a free slot, evicting with the CLOCK algorithm when the shard is full
+static cache_block_t *take_slot(cache_shard_t *shard) {
+    if (shard->used < shard->capacity) {
+        return &shard->blocks[shard->used++];
+    }
+
+    for (;;) {
+        cache_block_t *block = &shard->blocks[shard->hand];
+        shard->hand = (shard->hand + 1) % shard->capacity;
+
+        if (!block->in_use) {
+            return block;
+        }
+        // Recently used blocks get another round
+        if (block->referenced) {
+            block->referenced = 0;
+            continue;
+        }
+        unlink_block(shard, block);
+        shard->evictions++;
+        return block;
+    }
+}
+
+int block_cache_enable(size_t budget_bytes) {
+    if (shards) {
+        fprintf(stderr, "Block cache is already enabled\n");
+        return -1;
+    }
+
+    size_t capacity = budget_bytes / BLOCK_CACHE_BLOCK_SIZE / BLOCK_CACHE_SHARDS;
+    if (capacity == 0) {
+        capacity = 1;
+    }
+
+    shards = calloc(BLOCK_CACHE_SHARDS, sizeof(cache_shard_t));
+    if (!shards) {
+        perror("Error allocating block cache");
+        return -1;
+    }
+
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        cache_shard_t *shard = &shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->capacity = capacity;
+        shard->bucket_count = capacity * 2;
+
+        // Slots are only touched when first used, so the budget is not committed up front
+        shard->buckets = calloc(shard->bucket_count, sizeof(cache_block_t *));
+        shard->blocks = calloc(capacity, sizeof(cache_block_t));
+        if (!shard->buckets || !shard->blocks) {
+            perror("Error allocating block cache");
+            block_cache_disable();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void block_cache_disable(void) {
+    if (!shards) {
+        return;
+    }
+
+    pthread_mutex_lock(&files_lock);
+    for (size_t i = 0; i < file_capacity; i++) {
+        free(files[i]);
+    }
+    free(files);
+    files = NULL;
+    file_capacity = 0;
+    file_count = 0;
+    pthread_mutex_unlock(&files_lock);
+
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        pthread_mutex_destroy(&shards[i].lock);
+        free(shards[i].buckets);
+        free(shards[i].blocks);
+    }
+    free(shards);
+    shards = NULL;
+}
+
+int block_cache_enabled(void) {
+    return shards != NULL;
+}
+
+// Find the slot of a file, or the empty slot where it would go, files_lock must be held
+static block_cache_file_t **find_file(block_cache_file_t **table, size_t capacity, dev_t dev, ino_t ino) {
+    size_t index = hash_key(dev, ino, 0) & (capacity - 1);
+    while (table[index] && (table[index]->ino != ino || table[index]->dev != dev)) {
+        index = (index + 1) & (capacity - 1);
+    }
+    return &table[index];
+}
+
+// Double the file table and move every file over, files_lock must be held
+static int grow_files(void) {
+    size_t new_capacity = file_capacity ? file_capacity * 2 : 256;
+    block_cache_file_t **table = calloc(new_capacity, sizeof(block_cache_file_t *));
+    if (!table) {
+        perror("Error allocating block cache file table");
+        return -1;
+    }
+
+    for (size_t i = 0; i < file_capacity; i++) {
+        if (files[i]) {
+            *find_file(table, new_capacity, files[i]->dev, files[i]->ino) = files[i];
+        }
+    }
+
+    free(files);
+    files = table;
+    file_capacity = new_capacity;
+    return 0;
+}
+
+static int same_time(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+block_cache_file_t *block_cache_open(const struct stat *status, int truncated) {
+    if (!shards) {
+        return NULL;
+    }
+
+    block_cache_file_t *file = NULL;
+    int changed = 0;
+    pthread_mutex_lock(&files_lock);
+    // Keep the table at most 70% full
+    if ((file_count + 1) * 10 <= file_capacity * 7 || grow_files() == 0) {
+        block_cache_file_t **slot = find_file(files, file_capacity, status->st_dev, status->st_ino);
+        if (*slot) {
+            file = *slot;
+            changed = truncated || file->size != status->st_size
+                      || !same_time(&file->mtime, &status->st_mtim) || !same_time(&file->ctime, &status->st_ctim);
+        } else if ((file = calloc(1, sizeof(block_cache_file_t)))) {
+            // Blocks only ever belong to a record, so a new one has none to drop
+            file->dev = status->st_dev;
+            file->ino = status->st_ino;
+            *slot = file;
+            file_count++;
+        } else {
+            perror("Error allocating block cache file");
+        }
+        if (file) {
+            file->size = status->st_size;
+            file->mtime = status->st_mtim;
+            file->ctime = status->st_ctim;
+        }
+    }
+    pthread_mutex_unlock(&files_lock);
+
+    if (changed) {
+        block_cache_invalidate(file);
+    }
+    return file;
+}
+
+ssize_t block_cache_read(int fd, block_cache_file_t *file, off_t offset, void *buf, size_t count) {
+    char *ptr = buf;
+    size_t total = 0;
+
+    while (total < count) {
+        uint64_t index = (uint64_t)offset / BLOCK_CACHE_BLOCK_SIZE;
+        size_t within = (size_t)(offset % BLOCK_CACHE_BLOCK_SIZE);
+
+        cache_block_t **bucket;
+        cache_shard_t *shard = shard_for(file, index, &bucket);
+        pthread_mutex_lock(&shard->lock);
+
+        // A short block is only trusted as end of file when it covers what is asked for,
+        // the file may have grown through a write past the cached end
+        cache_block_t *block = find_block(bucket, file, index);
+        size_t wanted_end = within + (count - total);
+        if (block && (block->length == BLOCK_CACHE_BLOCK_SIZE || block->length >= wanted_end)) {
+            shard->hits++;
+        } else {
+            shard->misses++;
+            int fresh = block == NULL;
+            if (fresh) {
+                block = take_slot(shard);
+            }
+
+            // Fill the block under the lock so a concurrent update cannot be lost behind the read
+            ssize_t n = pread(fd, block->data, BLOCK_CACHE_BLOCK_SIZE, (off_t)(index * BLOCK_CACHE_BLOCK_SIZE));
+            if (n <= 0) {
+                if (!fresh) {
+                    unlink_block(shard, block);
+                    shard->invalidations++;
+                }
+                pthread_mutex_unlock(&shard->lock);
+                if (n == -1) {
+                    perror("Error reading block into cache");
+                    return total > 0 ? (ssize_t)total : -1;
+                }
+                break;
+            }
+            block->length = n;
+
+            if (fresh) {
+                block->file = file;
+                block->index = index;
+                link_block(shard, bucket, block);
+            }
+        }
+        block->referenced = 1;
+
+        // Copy out what the block holds past the current offset
+        size_t available = block->length > within ? block->length - within : 0;
+        size_t to_copy = count - total < available ? count - total : available;
+        memcpy(ptr + total, block->data + within, to_copy);
+        int end_of_file = block->length < BLOCK_CACHE_BLOCK_SIZE;
+        pthread_mutex_unlock(&shard->lock);
+
+        total += to_copy;
+        offset += to_copy;
+        if (end_of_file || to_copy == 0) {
+            break;
+        }
+    }
+
+    return total;
+}
+
+void block_cache_update(block_cache_file_t *file, off_t offset, const void *buf, size_t count) {
+    const char *ptr = buf;
+
+    while (count > 0) {
+        uint64_t index = (uint64_t)offset / BLOCK_CACHE_BLOCK_SIZE;
+        size_t within = (size_t)(offset % BLOCK_CACHE_BLOCK_SIZE);
+        size_t chunk = BLOCK_CACHE_BLOCK_SIZE - within < count ? BLOCK_CACHE_BLOCK_SIZE - within : count;
+
+        cache_block_t **bucket;
+        cache_shard_t *shard = shard_for(file, index, &bucket);
+        pthread_mutex_lock(&shard->lock);
+
+        cache_block_t *block = find_block(bucket, file, index);
+        if (block) {
+            if (within > block->length) {
+                // The write leaves a hole after the cached end of file, let the next read fetch it
+                unlink_block(shard, block);
+                shard->invalidations++;
+            } else {
+                memcpy(block->data + within, ptr, chunk);
+                if (within + chunk > block->length) {
+                    block->length = within + chunk;
+                }
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+
+        ptr += chunk;
+        offset += chunk;
+        count -= chunk;
+    }
+}
+
+void block_cache_invalidate(block_cache_file_t *file) {
+    if (!shards) {
+        return;
+    }
+
+    // Blocks of one file are spread over every shard, each shard keeps them on the file's list
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        cache_shard_t *shard = &shards[i];
+        pthread_mutex_lock(&shard->lock);
+        while (file->blocks[i]) {
+            unlink_block(shard, file->blocks[i]);
+            shard->invalidations++;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void block_cache_stats(block_cache_stats_t *out) {
+    memset(out, 0, sizeof(*out));
+    if (!shards) {
+        return;
+    }
+
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        cache_shard_t *shard = &shards[i];
+        pthread_mutex_lock(&shard->lock);
+        out->hits += shard->hits;
+        out->misses += shard->misses;
+        out->evictions += shard->evictions;
+        out->invalidations += shard->invalidations;
+        out->blocks_cached += shard->blocks_cached;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
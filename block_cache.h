@@ -0,0 +1,55 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Size of one cached block, matches the buffered_file_t buffer size
+#define BLOCK_CACHE_BLOCK_SIZE 4096
+
+// Number of independently locked parts of the cache
+#define BLOCK_CACHE_SHARDS 16
+
+// A file known to the cache, the handle its blocks are read and updated through
+typedef struct block_cache_file block_cache_file_t;
+
+// Hit and miss counters summed over all shards
+typedef struct {
+    uint64_t hits;              // Block lookups served from memory
+    uint64_t misses;            // Block lookups that had to read the file
+    uint64_t evictions;         // Blocks dropped to stay within the memory budget
+    uint64_t invalidations;     // Blocks dropped because their file changed in a way the cache cannot follow
+    uint64_t blocks_cached;     // Blocks currently held
+} block_cache_stats_t;
+
+// Turn on the process-wide cache with a memory budget in bytes for block data
+int block_cache_enable(size_t budget_bytes);
+
+// Free every cached block and turn the cache off, no handle may be using it at the time
+void block_cache_disable(void);
+
+// Check whether the cache is on
+int block_cache_enabled(void);
+
+// Get the cache's record of a file that is being opened. A file seen before is checked against the size
+// and times the cache saw when it was last opened, dropping its blocks if it changed in between
+// (truncated, written by someone else, or a new file that reuses the inode number). truncated drops
+// them unconditionally. Returns NULL when the cache is off or the file cannot be recorded, the file
+// is then read without the cache.
+block_cache_file_t *block_cache_open(const struct stat *status, int truncated);
+
+// Read count bytes at offset of file, open as fd, filling missing blocks with pread.
+// Returns the number of bytes read, short only at end of file, or -1 on error.
+ssize_t block_cache_read(int fd, block_cache_file_t *file, off_t offset, void *buf, size_t count);
+
+// Apply data just written at offset to the cached blocks of the file so they stay current
+void block_cache_update(block_cache_file_t *file, off_t offset, const void *buf, size_t count);
+
+// Drop every cached block of a file, in time proportional to the number of blocks it has
+void block_cache_invalidate(block_cache_file_t *file);
+
+// Get the current counters
+void block_cache_stats(block_cache_stats_t *out);
+
+#endif // BLOCK_CACHE_H
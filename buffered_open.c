@@ -1,10 +1,12 @@
 #include "buffered_open.h"
+#include "block_cache.h"
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 // Function to open a file with buffered I/O
 buffered_file_t *buffered_open(const char *pathname, int flags, ...) {
@@ -18,6 +20,13 @@ buffered_file_t *buffered_open(const char *pathname, int flags, ...) {
         va_end(args);
     }
 
+    // Prepending rewrites the file in place, which can never be atomic
+    if ((flags & O_ATOMIC_APPEND) && (flags & O_PREAPPEND)) {
+        errno = EINVAL;
+        perror("Error opening file with both O_ATOMIC_APPEND and O_PREAPPEND");
+        return NULL;
+    }
+
     // Allocate memory for buffered_file_t structure
     buffered_file_t *bf = malloc(sizeof(buffered_file_t));
     if (!bf) {
@@ -49,8 +58,14 @@ buffered_file_t *buffered_open(const char *pathname, int flags, ...) {
         bf->preappend = 0;
     }
 
-    // Remove O_PREAPPEND flag before calling open
-    bf->flags = flags & ~O_PREAPPEND;
+    // Check if O_ATOMIC_APPEND flag is set
+    bf->atomic_append = (flags & O_ATOMIC_APPEND) ? 1 : 0;
+
+    // Remove our own flags before calling open, atomic append relies on the kernel's O_APPEND
+    bf->flags = flags & ~(O_PREAPPEND | O_ATOMIC_APPEND);
+    if (bf->atomic_append) {
+        bf->flags |= O_APPEND;
+    }
     
     // Open the file with the appropriate flags and mode
     if (flags & O_CREAT) {
@@ -70,16 +85,201 @@ buffered_file_t *buffered_open(const char *pathname, int flags, ...) {
     bf->read_buffer_size = BUFFER_SIZE;
     bf->write_buffer_size = BUFFER_SIZE;
     bf->read_buffer_pos = 0;
+    bf->read_buffer_len = 0;
     bf->write_buffer_pos = 0;
 
+    // Remember which file this is so its blocks can be shared with other handles,
+    // blocks left from before a truncation or from an earlier file with the same inode are dropped
+    bf->cached = 0;
+    bf->cache_file = NULL;
+    struct stat statbuf;
+    if (block_cache_enabled() && fstat(bf->fd, &statbuf) == 0 && S_ISREG(statbuf.st_mode)) {
+        bf->cache_file = block_cache_open(&statbuf, (flags & O_TRUNC) != 0);
+        bf->cached = bf->cache_file != NULL;
+    }
+
+    // Cached handles that write at their own offset keep it in user space, appending and
+    // prepending handles depend on where the kernel puts their data and keep using the descriptor
+    bf->positional = bf->cached && !bf->preappend && !bf->atomic_append && !(bf->flags & O_APPEND);
+    bf->position = 0;
+    bf->write_offset = 0;
+    if (bf->positional || bf->atomic_append) {
+        // The kernel already truncated the file, a second truncation at the first flush would
+        // throw away whatever other handles or processes wrote in between
+        bf->flags &= ~O_TRUNC;
+    }
+
     return bf;
 }
 
+// Drop the shared cache's copy of a file whose contents were moved around
+static void cache_invalidate(buffered_file_t *bf) {
+    if (bf->cached) {
+        block_cache_invalidate(bf->cache_file);
+    }
+}
+
+// Apply a write that just ended at the file position to the shared cache
+static void cache_update(buffered_file_t *bf, const void *buf, size_t count) {
+    if (!bf->cached) {
+        return;
+    }
+
+    // With O_APPEND the kernel picks the offset, so take it from where the write ended
+    off_t end = lseek(bf->fd, 0, SEEK_CUR);
+    if (end == -1) {
+        cache_invalidate(bf);
+        return;
+    }
+    block_cache_update(bf->cache_file, end - (off_t)count, buf, count);
+}
+
+// Serve a read from the shared cache and move the file position past it
+static ssize_t cached_read(buffered_file_t *bf, void *buf, size_t count) {
+    off_t position = lseek(bf->fd, 0, SEEK_CUR);
+    if (position == -1) {
+        perror("Error getting current position in file");
+        return -1;
+    }
+
+    ssize_t n = block_cache_read(bf->fd, bf->cache_file, position, buf, count);
+    if (n == -1) {
+        return -1;
+    }
+
+    if (lseek(bf->fd, position + n, SEEK_SET) == -1) {
+        perror("Error seeking to new position after reading");
+        return -1;
+    }
+
+    // Null-terminate the data when there is room, like the uncached path
+    if ((size_t)n < count) {
+        ((char *)buf)[n] = '\0';
+    }
+    return n;
+}
+
+// Read count bytes at offset for a positional handle: the cached file contents with the pending
+// writes laid over them, so nothing has to be flushed first
+static ssize_t positional_read(buffered_file_t *bf, off_t offset, void *buf, size_t count) {
+    char *ptr = buf;
+    ssize_t n = block_cache_read(bf->fd, bf->cache_file, offset, buf, count);
+    if (n == -1) {
+        return -1;
+    }
+
+    off_t pending_start = bf->write_offset;
+    off_t pending_end = bf->write_offset + (off_t)bf->write_buffer_pos;
+    off_t read_end = offset + (off_t)count;
+    if (bf->write_buffer_pos > 0 && pending_start < read_end && pending_end > offset) {
+        off_t from = pending_start > offset ? pending_start : offset;
+        off_t to = pending_end < read_end ? pending_end : read_end;
+
+        // Pending data past the end of the file leaves a hole before it, which reads as zeros
+        if (from > offset + n) {
+            memset(ptr + n, 0, from - offset - n);
+        }
+        memcpy(ptr + (from - offset), bf->write_buffer + (from - pending_start), to - from);
+        if (to - offset > n) {
+            n = to - offset;
+        }
+    }
+    return n;
+}
+
+// Write the pending data of a positional handle at the offset it belongs to
+static int positional_flush(buffered_file_t *bf) {
+    size_t written = 0;
+    while (written < bf->write_buffer_pos) {
+        ssize_t n = pwrite(bf->fd, bf->write_buffer + written, bf->write_buffer_pos - written,
+                           bf->write_offset + (off_t)written);
+        if (n == -1) {
+            perror("Error writing buffer to file");
+            return -1;
+        }
+        written += n;
+    }
+
+    block_cache_update(bf->cache_file, bf->write_offset, bf->write_buffer, written);
+    bf->write_offset += written;
+    bf->write_buffer_pos = 0;
+    return 0;
+}
+
+// Buffer a write of a positional handle at its offset
+static ssize_t positional_write(buffered_file_t *bf, const void *buf, size_t count) {
+    const char *ptr = buf;
+
+    // The write may cover bytes the record API read ahead
+    bf->read_buffer_pos = 0;
+    bf->read_buffer_len = 0;
+
+    // The buffer holds one contiguous run, a write anywhere else sends it out first
+    if (bf->write_buffer_pos > 0 && bf->write_offset + (off_t)bf->write_buffer_pos != bf->position) {
+        if (positional_flush(bf) == -1) {
+            return -1;
+        }
+    }
+
+    size_t remaining = count;
+    while (remaining > 0) {
+        if (bf->write_buffer_pos == 0) {
+            bf->write_offset = bf->position;
+        }
+        size_t space = bf->write_buffer_size - bf->write_buffer_pos;
+        size_t to_copy = remaining < space ? remaining : space;
+
+        memcpy(bf->write_buffer + bf->write_buffer_pos, ptr, to_copy);
+        bf->write_buffer_pos += to_copy;
+        bf->position += to_copy;
+        ptr += to_copy;
+        remaining -= to_copy;
+
+        if (bf->write_buffer_pos == bf->write_buffer_size && positional_flush(bf) == -1) {
+            return -1;
+        }
+    }
+    return count;
+}
+
+// Write one record in atomic append mode, it never shares a write() with part of another record
+static ssize_t atomic_append_write(buffered_file_t *bf, const void *buf, size_t count) {
+    // Flush what is buffered if the record would not fit behind it
+    if (bf->write_buffer_pos + count > bf->write_buffer_size) {
+        if (buffered_flush(bf) == -1) {
+            return -1;
+        }
+    }
+
+    // A record larger than the whole buffer goes out on its own
+    if (count > bf->write_buffer_size) {
+        ssize_t written = write(bf->fd, buf, count);
+        if (written != (ssize_t)count) {
+            perror("Error writing record to file");
+            return -1;
+        }
+        cache_update(bf, buf, written);
+        return count;
+    }
+
+    memcpy(bf->write_buffer + bf->write_buffer_pos, buf, count);
+    bf->write_buffer_pos += count;
+    return count;
+}
+
 // Function to write data to the buffered file
 ssize_t buffered_write(buffered_file_t *bf, const void *buf, size_t count) {
     const char *ptr = buf;
     size_t remaining = count;
 
+    // In atomic append mode every call is one record and is never split
+    if (bf->atomic_append) {
+        return atomic_append_write(bf, buf, count);
+    }
+    if (bf->positional) {
+        return positional_write(bf, buf, count);
+    }
+
     while (remaining > 0) {
         size_t space = BUFFER_SIZE - bf->write_buffer_pos;
         size_t to_copy = remaining < space ? remaining : space;
@@ -101,6 +301,116 @@ ssize_t buffered_write(buffered_file_t *bf, const void *buf, size_t count) {
     return count - remaining;
 }
 
+// Give back the bytes the record API read ahead, so the file position matches what was consumed.
+// A positional handle's offset never includes them, so there it only empties the buffer.
+static int drop_read_ahead(buffered_file_t *bf) {
+    size_t unread = bf->read_buffer_len - bf->read_buffer_pos;
+    bf->read_buffer_pos = 0;
+    bf->read_buffer_len = 0;
+
+    if (unread > 0 && !bf->positional && lseek(bf->fd, -(off_t)unread, SEEK_CUR) == -1) {
+        perror("Error seeking back over read-ahead data");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to get the next delimited record as a view into the read buffer
+ssize_t buffered_next_record(buffered_file_t *bf, int delim, const char **record) {
+    // Pending writes go first so the record is read from the right place, positional reads see them anyway
+    if (!bf->positional && bf->write_buffer_pos > 0 && buffered_flush(bf) == -1) {
+        return -1;
+    }
+
+    // Only bytes that were not searched yet need to be looked at after a refill
+    size_t scanned = bf->read_buffer_pos;
+
+    for (;;) {
+        // glibc's memchr picks its AVX2, SSE2 or scalar search for this CPU at load time
+        const char *start = bf->read_buffer + bf->read_buffer_pos;
+        const char *found = memchr(bf->read_buffer + scanned, delim, bf->read_buffer_len - scanned);
+        if (found) {
+            // The record lies fully inside the buffer, hand it out without copying
+            size_t length = found - start + 1;
+            *record = start;
+            bf->read_buffer_pos += length;
+            bf->position += bf->positional ? (off_t)length : 0;
+            return length;
+        }
+        scanned = bf->read_buffer_len;
+
+        // Move the partial record to the front of the buffer to make room for the refill
+        if (bf->read_buffer_pos > 0) {
+            size_t partial = bf->read_buffer_len - bf->read_buffer_pos;
+            memmove(bf->read_buffer, start, partial);
+            bf->read_buffer_len = partial;
+            scanned = partial;
+            bf->read_buffer_pos = 0;
+        }
+
+        // Grow the buffer for a record longer than the buffer itself
+        if (bf->read_buffer_len == bf->read_buffer_size) {
+            char *grown = realloc(bf->read_buffer, bf->read_buffer_size * 2);
+            if (!grown) {
+                perror("Error allocating memory for read buffer");
+                return -1;
+            }
+            bf->read_buffer = grown;
+            bf->read_buffer_size *= 2;
+        }
+
+        // Refill the buffer after the partial record
+        char *refill = bf->read_buffer + bf->read_buffer_len;
+        size_t space = bf->read_buffer_size - bf->read_buffer_len;
+        ssize_t n;
+        if (bf->positional) {
+            n = positional_read(bf, bf->position + (off_t)(bf->read_buffer_len - bf->read_buffer_pos), refill, space);
+        } else {
+            n = read(bf->fd, refill, space);
+            if (n == -1) {
+                perror("Error reading from file");
+            }
+        }
+        if (n == -1) {
+            return -1;
+        }
+        if (n == 0) {
+            // End of file, whatever is left is the last record
+            size_t length = bf->read_buffer_len - bf->read_buffer_pos;
+            *record = bf->read_buffer + bf->read_buffer_pos;
+            bf->read_buffer_pos = bf->read_buffer_len;
+            bf->position += bf->positional ? (off_t)length : 0;
+            return length;
+        }
+        bf->read_buffer_len += n;
+    }
+}
+
+// Function to copy the next delimited record into a caller-owned buffer
+ssize_t buffered_getdelim(buffered_file_t *bf, char **lineptr, size_t *n, int delim) {
+    const char *record;
+    ssize_t length = buffered_next_record(bf, delim, &record);
+    // Like getdelim(), end of file and errors both return -1
+    if (length <= 0) {
+        return -1;
+    }
+
+    // Make room for the record and its terminating NUL
+    if (!*lineptr || *n < (size_t)length + 1) {
+        char *grown = realloc(*lineptr, length + 1);
+        if (!grown) {
+            perror("Error allocating memory for record");
+            return -1;
+        }
+        *lineptr = grown;
+        *n = length + 1;
+    }
+
+    memcpy(*lineptr, record, length);
+    (*lineptr)[length] = '\0';
+    return length;
+}
+
 // Function to read data from the buffered file
 ssize_t buffered_read(buffered_file_t *bf, void *buf, size_t count) {
     char *ptr = buf;
@@ -108,10 +418,34 @@ ssize_t buffered_read(buffered_file_t *bf, void *buf, size_t count) {
     size_t fd_size;
     size_t to_copy;
 
-    // Flush the write buffer before reading
+    // Put back anything the record API read ahead
+    if (drop_read_ahead(bf) == -1) {
+        return -1;
+    }
+
+    // A positional handle reads the cache with its pending writes laid over it, no flush needed
+    if (bf->positional) {
+        ssize_t n = positional_read(bf, bf->position, buf, count);
+        if (n == -1) {
+            return -1;
+        }
+        bf->position += n;
+
+        // Null-terminate the data when there is room, like the uncached path
+        if ((size_t)n < count) {
+            ptr[n] = '\0';
+        }
+        return n;
+    }
+
+    // Flush the write buffer before reading, with the cache on this also brings the cached blocks up to date
     if (buffered_flush(bf) == -1) {
         return -1;
     }
+
+    if (bf->cached) {
+        return cached_read(bf, buf, count);
+    }
     ptr[0] = '\0';
 
     // Now read from the file descriptor if more data is needed
@@ -164,11 +498,69 @@ ssize_t buffered_read(buffered_file_t *bf, void *buf, size_t count) {
         }
     }
 
+    // The file position is already past everything copied out, so nothing in the buffer is left unread
+    bf->read_buffer_len = bf->read_buffer_pos;
+
     // return the read data number
     return count - remaining;
 }
 
+// Function to move the handle's offset
+off_t buffered_seek(buffered_file_t *bf, off_t offset, int whence) {
+    if (!bf->positional) {
+        // The descriptor's offset is the handle's, so pending writes and read-ahead are settled first
+        if (buffered_flush(bf) == -1) {
+            return -1;
+        }
+        off_t result = lseek(bf->fd, offset, whence);
+        if (result == -1) {
+            perror("Error seeking in file");
+        }
+        return result;
+    }
+
+    // Pending writes stay buffered, a later write somewhere else flushes them
+    drop_read_ahead(bf);
+
+    off_t base;
+    if (whence == SEEK_SET) {
+        base = 0;
+    } else if (whence == SEEK_CUR) {
+        base = bf->position;
+    } else if (whence == SEEK_END) {
+        struct stat statbuf;
+        if (fstat(bf->fd, &statbuf) == -1) {
+            perror("Error getting file size");
+            return -1;
+        }
+        // Pending data may extend the file
+        off_t pending_end = bf->write_offset + (off_t)bf->write_buffer_pos;
+        base = bf->write_buffer_pos > 0 && pending_end > statbuf.st_size ? pending_end : statbuf.st_size;
+    } else {
+        errno = EINVAL;
+        perror("Error seeking in file");
+        return -1;
+    }
+
+    if (base + offset < 0) {
+        errno = EINVAL;
+        perror("Error seeking in file");
+        return -1;
+    }
+    bf->position = base + offset;
+    return bf->position;
+}
+
 int buffered_flush(buffered_file_t *bf) {
+    // Writes go where the reader stopped, not where the read-ahead ended
+    if (drop_read_ahead(bf) == -1) {
+        return -1;
+    }
+
+    if (bf->positional) {
+        return bf->write_buffer_pos > 0 ? positional_flush(bf) : 0;
+    }
+
     if(bf->write_buffer_pos > 0) {
         // Handle O_TRUNC flag
         if (bf->flags & O_TRUNC) {
@@ -176,12 +568,14 @@ int buffered_flush(buffered_file_t *bf) {
                 perror("Error truncating file");
                 return -1;
             }
+            cache_invalidate(bf);
             // Remove the O_TRUNC flag after truncation
             bf->flags &= ~O_TRUNC;
         }
 
-        // Check if O_APPEND flag is set, so the offset has to change to the end of the file
-        if (bf->flags & O_APPEND) {
+        // Check if O_APPEND flag is set, so the offset has to change to the end of the file.
+        // In atomic append mode the kernel already does this on every write.
+        if ((bf->flags & O_APPEND) && !bf->atomic_append) {
             // Ensure the file pointer is at the end before writing if O_APPEND is set
             if (lseek(bf->fd, 0, SEEK_END) == -1) {
                 perror("Error seeking to end of file");
@@ -254,7 +648,8 @@ int buffered_flush(buffered_file_t *bf) {
             }
 
             free(temp_buffer);
-            
+            cache_invalidate(bf);
+
             // Remove the O_PREAPPEND flag after handling by put 2 to indicated that was preappend
             bf->preappend = 2;
         } else {
@@ -324,6 +719,7 @@ int buffered_flush(buffered_file_t *bf) {
                 }
 
                 free(second_buffer);
+                cache_invalidate(bf);
             } else {
                 // Write the buffer to the file
                 ssize_t written = write(bf->fd, bf->write_buffer, bf->write_buffer_pos);
@@ -331,13 +727,21 @@ int buffered_flush(buffered_file_t *bf) {
                     perror("Error writing buffer to file");
                     return -1;
                 }
+                // A short write would let another writer's data land between our records
+                if (bf->atomic_append && (size_t)written != bf->write_buffer_pos) {
+                    errno = EIO;
+                    perror("Error writing records atomically to file");
+                    return -1;
+                }
+                cache_update(bf, bf->write_buffer, written);
             }
         }
         // Reset the buffer position after writing
         bf->write_buffer_pos = 0;
     } else {
-        // Check if O_APPEND flag is set, so the offset has to change to the end of the file
-        if (bf->flags & O_APPEND) {
+        // Check if O_APPEND flag is set, so the offset has to change to the end of the file.
+        // In atomic append mode the kernel already does this on every write.
+        if ((bf->flags & O_APPEND) && !bf->atomic_append) {
             // Ensure the file pointer is at the end before writing if O_APPEND is set
             if (lseek(bf->fd, 0, SEEK_END) == -1) {
                 perror("Error seeking to end of file");
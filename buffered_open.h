@@ -4,10 +4,15 @@
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/types.h>
 
 // Define a new flag that doesn't collide with existing flags
 #define O_PREAPPEND 0x40000000
 
+// Define a flag for lock-free appends shared between processes: the file is opened with O_APPEND
+// and each buffered_write call is a record that reaches the file in a single write()
+#define O_ATOMIC_APPEND 0x20000000
+
 // Define the standard buffer size for read and write operations
 #define BUFFER_SIZE 4096
 
@@ -22,11 +27,22 @@ typedef struct {
     size_t write_buffer_size;   // Size of the write buffer, indicating how much data it can hold
 
     size_t read_buffer_pos;     // Current position in the read buffer, indicating the next byte to be read
+    size_t read_buffer_len;     // Number of valid bytes in the read buffer, read ahead of the file position by the record API
     size_t write_buffer_pos;    // Current position in the write buffer, indicating the next byte to be written
 
     int flags;                  // File flags used to control file access modes and options (like O_RDONLY, O_WRONLY)
 
     int preappend;              // Flag to remember if the O_PREAPPEND flag was used, indicating special handling for writes
+
+    int atomic_append;          // Flag to remember if the O_ATOMIC_APPEND flag was used, indicating writes are never split
+
+    int cached;                 // Flag to remember if reads go through the shared block cache (see block_cache.h)
+    struct block_cache_file *cache_file; // The block cache's record of the file, when cached
+
+    int positional;             // Flag for cached handles that keep their own offset and never move the descriptor's,
+                                // reads are served from the cache with pending writes laid over them
+    off_t position;             // Offset of the next byte the handle reads or writes, when positional
+    off_t write_offset;         // File offset the write buffer starts at, when positional
 } buffered_file_t;
 
 // Function to wrap the original open function
@@ -38,6 +54,18 @@ ssize_t buffered_write(buffered_file_t *bf, const void *buf, size_t count);
 // Function to read from the buffered file
 ssize_t buffered_read(buffered_file_t *bf, void *buf, size_t count);
 
+// Function to get the next record ending with delim as a view into the read buffer.
+// Returns the record length including the delimiter (the last record of the file may lack it),
+// 0 at end of file and -1 on error. The view stays valid until the next call on bf.
+ssize_t buffered_next_record(buffered_file_t *bf, int delim, const char **record);
+
+// Function to copy the next record ending with delim into a malloc'd, NUL-terminated buffer like getdelim()
+ssize_t buffered_getdelim(buffered_file_t *bf, char **lineptr, size_t *n, int delim);
+
+// Function to move the handle's offset like lseek(), use this instead of lseek() on fd,
+// which does not move a positional handle
+off_t buffered_seek(buffered_file_t *bf, off_t offset, int whence);
+
 // Function to flush the buffer to the file
 int buffered_flush(buffered_file_t *bf);
 
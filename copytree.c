@@ -1,4 +1,8 @@
+#define _GNU_SOURCE
 #include "copytree.h"
+#include "telemetry.h"
+#include "journal.h"
+#include "tree_index.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,6 +12,113 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <libgen.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+// Regular files smaller than this are ordered by inode even in extent mode
+#define EXTENT_ORDER_MIN_SIZE (1024 * 1024)
+
+// Files of at least this size bypass the page cache with O_DIRECT in cache-neutral mode
+#define DIRECT_MIN_SIZE (8 * 1024 * 1024)
+
+// Buffer size and alignment for O_DIRECT transfers
+#define DIRECT_CHUNK_SIZE (1024 * 1024)
+#define DIRECT_ALIGNMENT 4096
+
+// Number of files whose last range is still in writeback before the oldest one is waited for and dropped
+#define DEFERRED_DROP_FILES 64
+
+// How much is written between two drop-behind passes in cache-neutral mode, writeback of one
+// window runs while the next one is copied
+#define DROP_BEHIND_WINDOW (8 * 1024 * 1024)
+
+// Number of temporary names tried for one destination file before giving up
+#define TEMPORARY_ATTEMPTS 100
+
+// Set in extent order on the keys of files whose first extent is known, sorting them after the rest
+#define EXTENT_KEY_FLAG (1ULL << 63)
+
+// A file of the index with the key it is scheduled by
+typedef struct {
+    uint64_t key;           // Sort key for the current copy order
+    uint32_t entry;         // Index entry of the file
+} scheduled_entry_t;
+
+// Order in which files are copied once the tree is scanned
+static copy_order_t copy_order = COPY_ORDER_SIZE;
+
+// Whether file data is copied without leaving it in the page cache
+static int cache_neutral = 0;
+
+// Number of failed operations reported so far
+static unsigned long error_count = 0;
+
+// Aligned buffer shared by every cache-neutral copy of a run, allocated on first use
+static char *copy_buffer;
+
+// Destination range of a finished file whose writeback was started but not yet waited for
+typedef struct {
+    int fd;                 // Our own descriptor of the destination
+    off_t start;
+    off_t length;
+} deferred_drop_t;
+
+// Ring of the most recent deferred ranges, oldest at deferred_head
+static deferred_drop_t deferred[DEFERRED_DROP_FILES];
+static size_t deferred_head;
+static size_t deferred_count;
+
+// Destination, temporary name and descriptor and source status of the file being copied, the offset
+// of its next journal checkpoint and whether its temporary copy has one the journal can resume from
+static const char *checkpoint_dest;
+static int checkpoint_fd;
+static const char *checkpoint_temporary;
+static const struct stat *checkpoint_source;
+static off_t next_checkpoint;
+static int checkpoint_saved;
+
+// Serial number of the next temporary name this run tries
+static unsigned long temporary_serial;
+
+// Report a failed operation and count it in the telemetry
+static void report_error(const char *message) {
+    perror(message);
+    error_count++;
+    telemetry_add_error();
+}
+
+// Get the number of failed operations reported so far
+unsigned long copy_errors(void) {
+    return error_count;
+}
+
+// Set the order in which files are copied
+void set_copy_order(copy_order_t order) {
+    copy_order = order;
+}
+
+// Turn the cache-neutral copy mode on or off
+void set_cache_neutral(int enabled) {
+    cache_neutral = enabled;
+}
+
+// Translate an order name from the command line, returns -1 for an unknown name
+int parse_copy_order(const char *name, copy_order_t *order) {
+    if (strcmp(name, "readdir") == 0) {
+        *order = COPY_ORDER_READDIR;
+    } else if (strcmp(name, "inode") == 0) {
+        *order = COPY_ORDER_INODE;
+    } else if (strcmp(name, "extent") == 0) {
+        *order = COPY_ORDER_EXTENT;
+    } else if (strcmp(name, "size") == 0) {
+        *order = COPY_ORDER_SIZE;
+    } else {
+        return -1;
+    }
+    return 0;
+}
 
 // Helper function to create directories recursively with default permissions
 void create_directories(const char *dir_path) {
@@ -47,96 +158,563 @@ void create_directories(const char *dir_path) {
     }
 }
 
-// Function to copy a file
-void copy_file(const char *src, const char *dest, int copy_symlinks, int copy_permissions) {
-    // Get the status of the source file
-    struct stat statbuf;
-    if (lstat(src, &statbuf) == -1) {
-        perror("lstat failed");
+// Read from a file and record the time it took
+static ssize_t timed_read(int fd, void *buf, size_t count) {
+    uint64_t timer = telemetry_begin();
+    ssize_t n = read(fd, buf, count);
+    telemetry_end(TELEMETRY_READ, timer);
+    return n;
+}
+
+// Write to a file and record the time it took
+static ssize_t timed_write(int fd, const void *buf, size_t count) {
+    uint64_t timer = telemetry_begin();
+    ssize_t n = write(fd, buf, count);
+    telemetry_end(TELEMETRY_WRITE, timer);
+    return n;
+}
+
+// Record in the journal how far the destination got once enough was copied, syncing that much of the
+// temporary copy first
+static void checkpoint(off_t position) {
+    if (!journal_is_active() || position < next_checkpoint) {
+        return;
+    }
+    next_checkpoint = position + JOURNAL_PROGRESS_INTERVAL;
+    if (fdatasync(checkpoint_fd) == -1) {
+        report_error("fdatasync failed");
+        return;
+    }
+    journal_record_progress(checkpoint_dest, checkpoint_temporary, position, checkpoint_source);
+    checkpoint_saved = 1;
+}
+
+// Copy the rest of a file through the page cache, starting at position
+static int copy_buffered(int src_fd, int dest_fd, off_t position) {
+    // Buffer for file copying
+    char buf[8192];
+    ssize_t n;
+    while ((n = timed_read(src_fd, buf, sizeof(buf))) > 0) {
+        if (timed_write(dest_fd, buf, n) != n) {
+            report_error("write failed");
+            return -1;
+        }
+        position += n;
+        checkpoint(position);
+        telemetry_add_bytes(n);
+        telemetry_progress();
+    }
+
+    // Check for read errors
+    if (n == -1) {
+        report_error("read failed");
+        return -1;
+    }
+    return 0;
+}
+
+// Write back a range of the destination and drop it, and the matching source range, from the page cache
+static void drop_behind(int src_fd, int dest_fd, off_t start, off_t length) {
+    // Dirty pages cannot be dropped, so wait for them to reach the disk first
+    sync_file_range(dest_fd, start, length,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(dest_fd, start, length, POSIX_FADV_DONTNEED);
+    posix_fadvise(src_fd, start, length, POSIX_FADV_DONTNEED);
+}
+
+// Wait for the oldest deferred range and drop it from the page cache
+static void finish_oldest_drop(void) {
+    deferred_drop_t *oldest = &deferred[deferred_head];
+    sync_file_range(oldest->fd, oldest->start, oldest->length,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(oldest->fd, oldest->start, oldest->length, POSIX_FADV_DONTNEED);
+    close(oldest->fd);
+    deferred_head = (deferred_head + 1) % DEFERRED_DROP_FILES;
+    deferred_count--;
+}
+
+// Start writeback of the last range of a file and drop it only after DEFERRED_DROP_FILES more files,
+// so small files never wait for their own writeback. The clean source pages go right away.
+static void defer_drop(int src_fd, int dest_fd, off_t start, off_t length) {
+    sync_file_range(dest_fd, start, length, SYNC_FILE_RANGE_WRITE);
+    posix_fadvise(src_fd, start, length, POSIX_FADV_DONTNEED);
+    if (deferred_count == DEFERRED_DROP_FILES) {
+        finish_oldest_drop();
+    }
+
+    // The destination is closed before the drop, so keep a descriptor of our own
+    int fd = dup(dest_fd);
+    if (fd == -1) {
+        drop_behind(src_fd, dest_fd, start, length);
         return;
     }
+    deferred_drop_t *slot = &deferred[(deferred_head + deferred_count) % DEFERRED_DROP_FILES];
+    slot->fd = fd;
+    slot->start = start;
+    slot->length = length;
+    deferred_count++;
+}
+
+// Get the buffer for cache-neutral copies, aligned for O_DIRECT
+static char *get_copy_buffer(void) {
+    if (!copy_buffer && posix_memalign((void **)&copy_buffer, DIRECT_ALIGNMENT, DIRECT_CHUNK_SIZE) != 0) {
+        copy_buffer = NULL;
+        report_error("Failed to allocate copy buffer");
+    }
+    return copy_buffer;
+}
+
+// Finish the deferred drops and free the copy buffer once a run is over
+static void release_copy_state(void) {
+    while (deferred_count > 0) {
+        finish_oldest_drop();
+    }
+    free(copy_buffer);
+    copy_buffer = NULL;
+}
+
+// Copy the rest of a file through the page cache starting at position, dropping the pages behind the write cursor
+static int copy_drop_behind(int src_fd, int dest_fd, off_t position) {
+    // Let the kernel read ahead aggressively since the source is read once from start to end
+    posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    off_t window_start = position;      // Start of the window being written
+    off_t writeback_start = position;   // Start of the window whose writeback is in flight
+
+    char *buf = get_copy_buffer();
+    if (!buf) {
+        return -1;
+    }
+
+    ssize_t n;
+    while ((n = timed_read(src_fd, buf, DIRECT_CHUNK_SIZE)) > 0) {
+        if (timed_write(dest_fd, buf, n) != n) {
+            report_error("write failed");
+            return -1;
+        }
+        position += n;
+        checkpoint(position);
+        telemetry_add_bytes(n);
+        telemetry_progress();
+
+        // Once a full window has been written, start its writeback without waiting for it, and drop
+        // the window before it, whose writeback had the whole time this one took to finish
+        if (position - window_start >= DROP_BEHIND_WINDOW) {
+            sync_file_range(dest_fd, window_start, position - window_start, SYNC_FILE_RANGE_WRITE);
+            if (window_start > writeback_start) {
+                drop_behind(src_fd, dest_fd, writeback_start, window_start - writeback_start);
+            }
+            writeback_start = window_start;
+            window_start = position;
+        }
+    }
+
+    // Check for read errors
+    if (n == -1) {
+        report_error("read failed");
+        return -1;
+    }
+
+    // Wait for the window already in writeback, the last partial one is left for after the next file
+    if (window_start > writeback_start) {
+        drop_behind(src_fd, dest_fd, writeback_start, window_start - writeback_start);
+    }
+    if (position > window_start) {
+        defer_drop(src_fd, dest_fd, window_start, position - window_start);
+    }
+    return 0;
+}
+
+// Turn O_DIRECT on or off for an open file
+static int set_direct(int fd, int enabled) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1) {
+        return -1;
+    }
+    flags = enabled ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+    return fcntl(fd, F_SETFL, flags);
+}
+
+// Copy a file with O_DIRECT on both ends, starting at the aligned offset *position.
+// Returns 1 when the filesystem rejects O_DIRECT or a short read leaves the offset unaligned,
+// with both files back in buffered mode and *position set to the point where the copy has to continue.
+static int copy_direct(int src_fd, int dest_fd, off_t *position) {
+    if (set_direct(src_fd, 1) == -1) {
+        return 1;
+    }
+    if (set_direct(dest_fd, 1) == -1) {
+        set_direct(src_fd, 0);
+        return 1;
+    }
+
+    char *buf = get_copy_buffer();
+    if (!buf) {
+        set_direct(src_fd, 0);
+        set_direct(dest_fd, 0);
+        return -1;
+    }
+
+    int result = 0;
+    for (;;) {
+        ssize_t n = timed_read(src_fd, buf, DIRECT_CHUNK_SIZE);
+        if (n == 0) {
+            break;
+        }
+        if (n == -1) {
+            if (errno == EINVAL) {
+                // The source filesystem does not do direct reads
+                result = 1;
+            } else {
+                report_error("read failed");
+                result = -1;
+            }
+            break;
+        }
+
+        // The unaligned tail of the file cannot be written directly
+        size_t aligned = (size_t)n & ~(size_t)(DIRECT_ALIGNMENT - 1);
+        ssize_t written = aligned ? timed_write(dest_fd, buf, aligned) : 0;
+        if (written == -1 && errno == EINVAL) {
+            // The destination filesystem does not do direct writes, hand this chunk to the buffered path
+            written = 0;
+            result = 1;
+        } else if (written != (ssize_t)aligned) {
+            report_error("write failed");
+            result = -1;
+            break;
+        }
+
+        if ((size_t)written < (size_t)n) {
+            set_direct(dest_fd, 0);
+            ssize_t rest = n - written;
+            if (timed_write(dest_fd, buf + written, rest) != rest) {
+                report_error("write failed");
+                result = -1;
+                break;
+            }
+
+            // Push the tail out so it does not stay behind in the page cache
+            off_t end = lseek(dest_fd, 0, SEEK_CUR);
+            if (end != -1) {
+                defer_drop(src_fd, dest_fd, end - rest, rest);
+            }
+            if (result == 0) {
+                set_direct(dest_fd, 1);
+            }
+        }
+        *position += n;
+        checkpoint(*position);
+        telemetry_add_bytes(n);
+        telemetry_progress();
+
+        if (result != 0) {
+            break;
+        }
+
+        // A short read is not necessarily the end of the file (network filesystems, a growing source),
+        // but the offset is no longer aligned for another direct read, so the buffered path finishes the copy
+        if (n < DIRECT_CHUNK_SIZE) {
+            result = 1;
+            break;
+        }
+    }
+
+    set_direct(src_fd, 0);
+    set_direct(dest_fd, 0);
+    return result;
+}
+
+// Copy the contents of an open source file into an open destination file, both positioned at offset
+static int copy_file_data(int src_fd, int dest_fd, off_t offset, off_t size) {
+    if (!cache_neutral) {
+        return copy_buffered(src_fd, dest_fd, offset);
+    }
+
+    if (size >= DIRECT_MIN_SIZE) {
+        int result = copy_direct(src_fd, dest_fd, &offset);
+        if (result != 1) {
+            return result;
+        }
+        // O_DIRECT was rejected or stopped early, finish the copy with drop-behind instead
+    }
+    return copy_drop_behind(src_fd, dest_fd, offset);
+}
+
+// Build the path of the file called name in the directory of dest, out has room for PATH_MAX bytes
+static int sibling_path(char *out, const char *dest, const char *name) {
+    const char *slash = strrchr(dest, '/');
+    int directory_length = slash ? (int)(slash - dest + 1) : 0;
+    int length = snprintf(out, PATH_MAX, "%.*s%s", directory_length, dest, name);
+    if (length < 0 || length >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+// Build a new name a destination file can be written under before it is published. The process ID
+// and a serial number make it unique to this run, and callers create it exclusively and move on to
+// the next name when a file of that name exists, so a source file that happens to look like a
+// temporary copy is copied like any other and never replaced.
+static int temporary_path(char *out, const char *dest) {
+    const char *slash = strrchr(dest, '/');
+    char name[NAME_MAX + 1];
+    // Only the start of a long name is kept so the temporary name still fits in NAME_MAX
+    snprintf(name, sizeof(name), ".%.200s.%ld-%lu.copytree-tmp",
+             slash ? slash + 1 : dest, (long)getpid(), temporary_serial++);
+    return sibling_path(out, dest, name);
+}
+
+// Create a new temporary file for dest, returns its descriptor and leaves its path in out
+static int create_temporary(char *out, const char *dest, mode_t mode) {
+    for (int attempt = 0; attempt < TEMPORARY_ATTEMPTS; attempt++) {
+        if (temporary_path(out, dest) == -1) {
+            return -1;
+        }
+        int fd = open(out, O_WRONLY | O_CREAT | O_EXCL, mode);
+        if (fd != -1 || errno != EEXIST) {
+            return fd;
+        }
+    }
+    return -1;
+}
 
+// Create a new temporary symbolic link to target for dest, leaving its path in out
+static int create_temporary_link(char *out, const char *dest, const char *target) {
+    for (int attempt = 0; attempt < TEMPORARY_ATTEMPTS; attempt++) {
+        if (temporary_path(out, dest) == -1) {
+            return -1;
+        }
+        if (symlink(target, out) == 0) {
+            return 0;
+        }
+        if (errno != EEXIST) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+// Atomically move a finished temporary file to its final name and record it in the journal
+static int publish(const char *temporary, const char *dest, const struct stat *source) {
+    if (renameat(AT_FDCWD, temporary, AT_FDCWD, dest) == -1) {
+        report_error("rename failed");
+        unlink(temporary);
+        return -1;
+    }
+    journal_record_done(dest, source);
+    return 0;
+}
+
+// Check whether the journal says a destination file is finished from the source as it is now, and it is still there
+static int already_copied(const char *dest_path, const struct stat *source) {
+    return journal_is_done(dest_path, source)
+           && faccessat(AT_FDCWD, dest_path, F_OK, AT_SYMLINK_NOFOLLOW) == 0;
+}
+
+// Copy a file whose type, permissions and size are already known
+static void copy_known_file(const char *src, const char *dest, mode_t mode, off_t size,
+                            int copy_symlinks, int copy_permissions) {
     // Check if the source file is a symbolic link
-    if (S_ISLNK(statbuf.st_mode) && copy_symlinks) {
-        char link_des[1024];
+    if (S_ISLNK(mode) && copy_symlinks) {
+        char link_des[PATH_MAX];
         // Read the target of the symbolic link
-        ssize_t size = readlink(src, link_des, sizeof(link_des) - 1);
-        if (size == -1) {
-            perror("readlink failed");
+        ssize_t link_size = readlink(src, link_des, sizeof(link_des) - 1);
+        if (link_size == -1) {
+            report_error("readlink failed");
             return;
         }
-        link_des[size] = '\0';
-        
-        // Remove the existing symbolic link if it exists
-        if (remove(dest) == -1 && errno != ENOENT) {
-            perror("remove failed");
+        link_des[link_size] = '\0';
+
+        // The journal records which version of the link was copied
+        struct stat link_status;
+        uint64_t timer = telemetry_begin();
+        int stat_result = lstat(src, &link_status);
+        telemetry_end(TELEMETRY_STAT, timer);
+        if (stat_result == -1) {
+            report_error("lstat failed");
             return;
         }
 
-        // Create a new symbolic link
-        if (symlink(link_des, dest) == -1) {
-            perror("symlink failed");
+        // Create the new symbolic link and move it over the existing one
+        char temporary[PATH_MAX];
+        if (create_temporary_link(temporary, dest, link_des) == -1) {
+            report_error("symlink failed");
             return;
         }
+        if (publish(temporary, dest, &link_status) == -1) {
+            return;
+        }
+        telemetry_add_file();
     } else {
         // Open the source file
+        uint64_t timer = telemetry_begin();
         int src_file_descriptor = open(src, O_RDONLY);
+        telemetry_end(TELEMETRY_OPEN, timer);
         if (src_file_descriptor == -1) {
-            perror("open source file failed");
+            report_error("open source file failed");
+            return;
+        }
+
+        // Determine the permissions for the destination file, it has to stay writable until it is published
+        mode_t permissions_mode = copy_permissions ? mode : (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        permissions_mode |= S_IRUSR | S_IWUSR;
+
+        // The journal records which version of the source was copied
+        struct stat source_status;
+        timer = telemetry_begin();
+        int stat_result = fstat(src_file_descriptor, &source_status);
+        telemetry_end(TELEMETRY_STAT, timer);
+        if (stat_result == -1) {
+            report_error("fstat failed");
+            close(src_file_descriptor);
             return;
         }
 
-        // Determine the permissions for the destination file
-        mode_t permissions_mode = copy_permissions ? statbuf.st_mode : (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-        // Open the destination file
-        int dest_file_descriptor = open(dest, O_WRONLY | O_CREAT | O_TRUNC, permissions_mode);
+        // Pick up an interrupted copy from its last checkpoint, on an offset O_DIRECT can start from
+        const char *saved_name;
+        off_t offset = journal_resume_offset(dest, &source_status, &saved_name) & ~(off_t)(DIRECT_ALIGNMENT - 1);
+
+        // The data goes to a temporary name so nobody sees a half-written destination
+        char temporary[PATH_MAX];
+        int dest_file_descriptor = -1;
+        timer = telemetry_begin();
+        if (saved_name && sibling_path(temporary, dest, saved_name) == 0) {
+            if (offset > 0) {
+                dest_file_descriptor = open(temporary, O_WRONLY | O_NOFOLLOW);
+            } else {
+                // The journal's copy was made from an older version of the source and is of no use
+                unlink(temporary);
+            }
+        }
         if (dest_file_descriptor == -1) {
-            perror("open destination file failed");
+            offset = 0;
+            dest_file_descriptor = create_temporary(temporary, dest, permissions_mode);
+        }
+        telemetry_end(TELEMETRY_OPEN, timer);
+        if (dest_file_descriptor == -1) {
+            report_error("open destination file failed");
             close(src_file_descriptor);
             return;
         }
 
-        // Buffer for file copying
-        char buf[8192];
-        ssize_t n;
-        // Copy the file
-        while ((n = read(src_file_descriptor, buf, sizeof(buf))) > 0) {
-            if (write(dest_file_descriptor, buf, n) != n) {
-                perror("write failed");
+        if (offset > 0) {
+            // Only resume when the temporary file still holds everything up to the checkpoint
+            struct stat temporary_status;
+            if (fstat(dest_file_descriptor, &temporary_status) == -1 || temporary_status.st_size < offset) {
+                offset = 0;
+            }
+            if (ftruncate(dest_file_descriptor, offset) == -1
+                || lseek(src_file_descriptor, offset, SEEK_SET) == -1
+                || lseek(dest_file_descriptor, offset, SEEK_SET) == -1) {
+                report_error("Failed to resume destination file");
                 close(src_file_descriptor);
                 close(dest_file_descriptor);
+                unlink(temporary);
                 return;
             }
         }
 
-        // Check for read errors
-        if (n == -1) {
-            perror("read failed");
+        // Copy the file
+        const char *slash = strrchr(temporary, '/');
+        checkpoint_dest = dest;
+        checkpoint_temporary = slash ? slash + 1 : temporary;
+        checkpoint_fd = dest_file_descriptor;
+        checkpoint_source = &source_status;
+        next_checkpoint = offset + JOURNAL_PROGRESS_INTERVAL;
+        checkpoint_saved = offset > 0;
+        if (copy_file_data(src_file_descriptor, dest_file_descriptor, offset, size) == -1) {
+            // A partial copy with a checkpoint stays for --resume, any other one is of no use
+            close(src_file_descriptor);
+            close(dest_file_descriptor);
+            if (!checkpoint_saved) {
+                unlink(temporary);
+            }
+            return;
         }
 
-        // Close the source and destination files
-        close(src_file_descriptor);
-        close(dest_file_descriptor);
-
         // Copy the file permissions if required
         if (copy_permissions) {
-            if (chmod(dest, statbuf.st_mode) == -1) {
-                perror("chmod failed");
+            timer = telemetry_begin();
+            int chmod_result = fchmod(dest_file_descriptor, mode);
+            telemetry_end(TELEMETRY_CHMOD, timer);
+            if (chmod_result == -1) {
+                report_error("chmod failed");
             }
         }
+
+        // Close the source and destination files
+        close(src_file_descriptor);
+        if (close(dest_file_descriptor) == -1) {
+            report_error("close destination file failed");
+            unlink(temporary);
+            return;
+        }
+
+        if (publish(temporary, dest, &source_status) == -1) {
+            return;
+        }
+        telemetry_add_file();
     }
 }
-// Function to recursively copy a directory
-void copy_directory(const char *src, const char *dest, int copy_symlinks, int copy_permissions) {
-    // Open the source directory
-    DIR *source_dir = opendir(src);
-    if (source_dir == NULL) {
-        perror("Failed to open source directory");
+
+// Function to copy a file
+void copy_file(const char *src, const char *dest, int copy_symlinks, int copy_permissions) {
+    // Get the status of the source file
+    struct stat statbuf;
+    uint64_t timer = telemetry_begin();
+    int stat_result = lstat(src, &statbuf);
+    telemetry_end(TELEMETRY_STAT, timer);
+    if (stat_result == -1) {
+        report_error("lstat failed");
         return;
     }
 
-    // Create the destination directory
-    create_directories(dest);
+    copy_known_file(src, dest, statbuf.st_mode, statbuf.st_size, copy_symlinks, copy_permissions);
+    release_copy_state();
+}
+
+// Find the physical byte offset of the first extent of a file, returns -1 if there is none
+static int first_physical_extent(const char *path, uint64_t *physical) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+
+    // Room for the request header and exactly one extent
+    union {
+        struct fiemap map;
+        char storage[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.map.fm_start = 0;
+    request.map.fm_length = FIEMAP_MAX_OFFSET;
+    request.map.fm_extent_count = 1;
+
+    int result = -1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &request.map) == 0 && request.map.fm_mapped_extents > 0) {
+        // Extents without a real location (inline, delayed allocation) tell us nothing about placement
+        const struct fiemap_extent *extent = &request.map.fm_extents[0];
+        if (!(extent->fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE))) {
+            *physical = extent->fe_physical;
+            result = 0;
+        }
+    }
+
+    close(fd);
+    return result;
+}
+
+// Scan one open directory into the index, dest_path holds its destination path and has room for PATH_MAX bytes.
+// Without copy_symlinks the files symbolic links point to are copied, and checked against the journal.
+static void scan_directory(tree_index_t *index, int dir_fd, uint32_t parent, char *dest_path, size_t dest_length,
+                           int copy_symlinks) {
+    DIR *source_dir = fdopendir(dir_fd);
+    if (source_dir == NULL) {
+        report_error("Failed to open source directory");
+        close(dir_fd);
+        return;
+    }
 
     // Entry for directory reading
     struct dirent *dir_entry;
@@ -145,38 +723,211 @@ void copy_directory(const char *src, const char *dest, int copy_symlinks, int co
         if (strcmp(dir_entry->d_name, ".") == 0 || strcmp(dir_entry->d_name, "..") == 0) {
             continue;
         }
+        telemetry_add_entry();
 
-        // Prepare the source and destination paths
-        char source_path[512];
-        char destination_path[512];
-        snprintf(source_path, sizeof(source_path), "%s/%s", src, dir_entry->d_name);
-        snprintf(destination_path, sizeof(destination_path), "%s/%s", dest, dir_entry->d_name);
+        // Extend the destination path with this entry
+        size_t name_length = strlen(dir_entry->d_name);
+        if (dest_length + 1 + name_length >= PATH_MAX) {
+            errno = ENAMETOOLONG;
+            report_error("Failed to build destination path");
+            continue;
+        }
+        dest_path[dest_length] = '/';
+        memcpy(dest_path + dest_length + 1, dir_entry->d_name, name_length + 1);
 
-        // Get the status of the source path
+        // Get the status of the entry relative to its directory, no full source path needed
         struct stat status_buffer;
-        if (lstat(source_path, &status_buffer) == -1) {
-            perror("Failed to get status of source path");
+        uint64_t timer = telemetry_begin();
+        int stat_result = fstatat(dirfd(source_dir), dir_entry->d_name, &status_buffer, AT_SYMLINK_NOFOLLOW);
+        telemetry_end(TELEMETRY_STAT, timer);
+        if (stat_result == -1) {
+            report_error("Failed to get status of source path");
             continue;
         }
 
-        // Check if the source path is a directory
+        // Files finished before an interrupted run are not looked at again, unless the source changed since.
+        // A link that is followed was recorded with the status of its target.
+        if (!S_ISDIR(status_buffer.st_mode) && journal_is_active()) {
+            struct stat copied_status;
+            const struct stat *copied = &status_buffer;
+            if (S_ISLNK(status_buffer.st_mode) && !copy_symlinks) {
+                timer = telemetry_begin();
+                stat_result = fstatat(dirfd(source_dir), dir_entry->d_name, &copied_status, 0);
+                telemetry_end(TELEMETRY_STAT, timer);
+                copied = stat_result == 0 ? &copied_status : NULL;
+            }
+            if (copied && already_copied(dest_path, copied)) {
+                continue;
+            }
+        }
+
+        uint32_t entry = tree_index_add(index, parent, dir_entry->d_name, status_buffer.st_mode,
+                                        status_buffer.st_size, status_buffer.st_ino);
+
+        // Descend into subdirectories right away so they get indexed under this entry
         if (S_ISDIR(status_buffer.st_mode)) {
-            // Recursively copy the directory
-            copy_directory(source_path, destination_path, copy_symlinks, copy_permissions);
-            // Copy permissions if required
-            if (copy_permissions) {
-                if (chmod(destination_path, status_buffer.st_mode) == -1) {
-                    perror("Failed to copy permissions");
-                }
+            timer = telemetry_begin();
+            int child_fd = openat(dirfd(source_dir), dir_entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            telemetry_end(TELEMETRY_OPEN, timer);
+            if (child_fd == -1) {
+                report_error("Failed to open source directory");
+                continue;
             }
-        } else {
-            // Copy the file
-            copy_file(source_path, destination_path, copy_symlinks, copy_permissions);
+            scan_directory(index, child_fd, entry, dest_path, dest_length + 1 + name_length, copy_symlinks);
         }
+        telemetry_progress();
     }
+    dest_path[dest_length] = '\0';
 
     // Close the source directory
     if (closedir(source_dir) == -1) {
-        perror("Failed to close source directory");
+        report_error("Failed to close source directory");
+    }
+}
+
+// Build the path of an index entry under root, reporting paths that do not fit
+static int entry_path(const tree_index_t *index, uint32_t entry, const char *root, char *buf) {
+    if (tree_index_path(index, entry, root, buf, PATH_MAX) == 0) {
+        errno = ENAMETOOLONG;
+        report_error("Failed to build path");
+        return -1;
+    }
+    return 0;
+}
+
+// Compare two scheduled files by key, keeping scan order between equal keys
+static int compare_scheduled(const void *a, const void *b) {
+    const scheduled_entry_t *left = a;
+    const scheduled_entry_t *right = b;
+    if (left->key != right->key) {
+        return left->key < right->key ? -1 : 1;
+    }
+    return (left->entry > right->entry) - (left->entry < right->entry);
+}
+
+// Copy everything in the index from src to dest, files in the current copy order
+static void copy_indexed_tree(const tree_index_t *index, const char *src, const char *dest,
+                              int copy_symlinks, int copy_permissions) {
+    char *source_path = malloc(PATH_MAX);
+    char *destination_path = malloc(PATH_MAX);
+    scheduled_entry_t *schedule = malloc((index->file_count + 1) * sizeof(scheduled_entry_t));
+    if (!source_path || !destination_path || !schedule) {
+        report_error("Failed to allocate copy schedule");
+        free(source_path);
+        free(destination_path);
+        free(schedule);
+        return;
+    }
+
+    // Create every directory first, the index lists parents before their children
+    for (uint32_t entry = 0; entry < index->count; entry++) {
+        if (!S_ISDIR(tree_index_mode(index, entry)) || entry_path(index, entry, dest, destination_path) == -1) {
+            continue;
+        }
+        if (mkdir(destination_path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == -1 && errno != EEXIST) {
+            report_error("Error creating directory");
+        }
+    }
+
+    // Give every file its sort key
+    size_t count = 0;
+    for (uint32_t entry = 0; entry < index->count; entry++) {
+        mode_t mode = tree_index_mode(index, entry);
+        if (S_ISDIR(mode)) {
+            continue;
+        }
+
+        uint64_t key = entry;
+        if (copy_order == COPY_ORDER_SIZE) {
+            // Largest first, so the long copies start early and nothing big is left for the end
+            key = ~tree_index_size(index, entry);
+        } else if (copy_order == COPY_ORDER_INODE) {
+            key = tree_index_ino(index, entry);
+        } else if (copy_order == COPY_ORDER_EXTENT) {
+            // Files with a known first extent go after everything else, ordered by disk position
+            key = tree_index_ino(index, entry) & ~EXTENT_KEY_FLAG;
+            uint64_t physical;
+            if (S_ISREG(mode) && tree_index_size(index, entry) >= EXTENT_ORDER_MIN_SIZE
+                && entry_path(index, entry, src, source_path) == 0
+                && first_physical_extent(source_path, &physical) == 0) {
+                key = EXTENT_KEY_FLAG | physical;
+            }
+        }
+        schedule[count].key = key;
+        schedule[count].entry = entry;
+        count++;
+    }
+    if (copy_order != COPY_ORDER_READDIR) {
+        qsort(schedule, count, sizeof(scheduled_entry_t), compare_scheduled);
+    }
+
+    // The whole amount of work is known before the first byte is copied
+    telemetry_set_totals(index->file_count, index->total_bytes);
+
+    for (size_t i = 0; i < count; i++) {
+        uint32_t entry = schedule[i].entry;
+        if (entry_path(index, entry, src, source_path) == -1
+            || entry_path(index, entry, dest, destination_path) == -1) {
+            continue;
+        }
+        copy_known_file(source_path, destination_path, tree_index_mode(index, entry),
+                        (off_t)tree_index_size(index, entry), copy_symlinks, copy_permissions);
+        telemetry_progress();
+    }
+
+    // Directory permissions go last and deepest first, so a read-only directory never blocks its contents
+    if (copy_permissions) {
+        for (uint32_t entry = index->count; entry-- > 0;) {
+            mode_t mode = tree_index_mode(index, entry);
+            if (!S_ISDIR(mode) || entry_path(index, entry, dest, destination_path) == -1) {
+                continue;
+            }
+            uint64_t timer = telemetry_begin();
+            int chmod_result = chmod(destination_path, mode);
+            telemetry_end(TELEMETRY_CHMOD, timer);
+            if (chmod_result == -1) {
+                report_error("Failed to copy permissions");
+            }
+        }
     }
+
+    free(source_path);
+    free(destination_path);
+    free(schedule);
+}
+
+// Function to recursively copy a directory: scan the whole tree into an index, then copy from it
+void copy_directory(const char *src, const char *dest, int copy_symlinks, int copy_permissions) {
+    // Open the source directory
+    uint64_t timer = telemetry_begin();
+    int dir_fd = open(src, O_RDONLY | O_DIRECTORY);
+    telemetry_end(TELEMETRY_OPEN, timer);
+    if (dir_fd == -1) {
+        report_error("Failed to open source directory");
+        return;
+    }
+
+    // Create the destination directory
+    create_directories(dest);
+
+    // Scan phase
+    char *dest_path = malloc(PATH_MAX);
+    size_t dest_length = strlen(dest);
+    if (!dest_path || dest_length >= PATH_MAX) {
+        errno = dest_path ? ENAMETOOLONG : ENOMEM;
+        report_error("Failed to prepare destination path");
+        free(dest_path);
+        close(dir_fd);
+        return;
+    }
+    memcpy(dest_path, dest, dest_length + 1);
+
+    tree_index_t *index = tree_index_create();
+    scan_directory(index, dir_fd, TREE_INDEX_ROOT, dest_path, dest_length, copy_symlinks);
+    free(dest_path);
+
+    // Copy phase
+    copy_indexed_tree(index, src, dest, copy_symlinks, copy_permissions);
+    release_copy_state();
+    tree_index_destroy(index);
 }
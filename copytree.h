@@ -5,6 +5,18 @@
 extern "C" {
 #endif
 
+// Order in which files are copied after the whole source tree has been scanned
+typedef enum {
+    COPY_ORDER_READDIR,     // Scan order, as readdir returned the entries
+    COPY_ORDER_INODE,       // Ascending inode number
+    COPY_ORDER_EXTENT,      // Like inode, but large files are copied by the position of their first extent
+    COPY_ORDER_SIZE         // Largest files first, the default
+} copy_order_t;
+
+void set_copy_order(copy_order_t order);
+int parse_copy_order(const char *name, copy_order_t *order);
+void set_cache_neutral(int enabled);
+unsigned long copy_errors(void);
 void copy_file(const char *src, const char *dest, int copy_symlinks, int copy_permissions);
 void copy_directory(const char *src, const char *dest, int copy_symlinks, int copy_permissions);
 void create_directories(const char *dir_path);
@@ -0,0 +1,642 @@
+#define _GNU_SOURCE
+#include "journal.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h>
+
+// Journal records are single lines:
+//   D <size> <sec> <nsec> <length> <path>\n
+//       the file was published under its final name
+//   P <offset> <size> <sec> <nsec> <length> <temporary> <length> <path>\n
+//       the temporary copy, the file named <temporary> next to <path>, holds valid data up to offset
+// size, sec and nsec are the source's size and modification time when the record was made, a source
+// that changed since then is copied again from the start.
+// Paths are relative to the destination root and length-prefixed so any file name round-trips.
+// A record cut short by a crash has no trailing newline and is ignored on replay.
+//
+// Records are not written as they happen. They collect in memory and a commit first syncs what they
+// describe: the data of every published file and the directories on the way to each recorded path,
+// which hold the renames. The copier syncs a temporary copy itself before recording progress on it.
+// Only then are the records appended and the journal synced, so a record never reaches the disk before
+// the data it describes. A crash loses at most one batch, whose files are copied again.
+
+// Size and modification time of a source file, what a record was made against
+typedef struct {
+    unsigned long long size;
+    unsigned long long mtime_sec;
+    unsigned long long mtime_nsec;
+} journal_version_t;
+
+// State of one destination file known to the journal
+typedef struct {
+    char *path;                 // Path relative to the destination root, NULL for an empty slot
+    off_t offset;               // Last recorded progress offset
+    char *temporary;            // Name of the temporary copy of the last progress record, NULL if none
+    int done;                   // Whether the file was published
+    journal_version_t version;  // Source version of the last record
+} journal_entry_t;
+
+static int journal_fd = -1;
+static int destination_fd = -1;    // The destination root, recorded paths are opened relative to it
+static char journal_path[PATH_MAX];
+static size_t root_length;
+
+// Records waiting for the next commit
+static char *pending;
+static size_t pending_length;
+static size_t pending_capacity;
+static size_t pending_files;
+static off_t pending_bytes;
+
+// Paths of the records waiting for the next commit, each a record type followed by the relative path
+// and a NUL
+static char *pending_paths;
+static size_t pending_paths_length;
+static size_t pending_paths_capacity;
+
+// Directories the commit in progress already synced, an open-addressing set of relative paths
+static char **synced;
+static size_t synced_capacity;
+static size_t synced_count;
+
+// Open-addressing table of replayed records, keyed by relative path
+static journal_entry_t *entries;
+static size_t entry_capacity;
+static size_t entry_count;
+
+// FNV-1a hash of a path
+static size_t hash_path(const char *path, size_t length) {
+    size_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)path[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Strip the destination root from a destination path
+static const char *relative_path(const char *dest_path) {
+    const char *relative = dest_path;
+    if (strlen(dest_path) >= root_length) {
+        relative += root_length;
+    }
+    while (*relative == '/') {
+        relative++;
+    }
+    return relative;
+}
+
+// Find the slot for a path, or the empty slot where it would go
+static journal_entry_t *find_slot(journal_entry_t *table, size_t capacity, const char *path, size_t length) {
+    size_t index = hash_path(path, length) & (capacity - 1);
+    while (table[index].path && (strlen(table[index].path) != length
+                                 || memcmp(table[index].path, path, length) != 0)) {
+        index = (index + 1) & (capacity - 1);
+    }
+    return &table[index];
+}
+
+// Double the table size and move every entry over
+static int grow_table(void) {
+    size_t new_capacity = entry_capacity ? entry_capacity * 2 : 1024;
+    journal_entry_t *table = calloc(new_capacity, sizeof(journal_entry_t));
+    if (!table) {
+        perror("Error allocating journal table");
+        return -1;
+    }
+
+    for (size_t i = 0; i < entry_capacity; i++) {
+        if (entries[i].path) {
+            *find_slot(table, new_capacity, entries[i].path, strlen(entries[i].path)) = entries[i];
+        }
+    }
+
+    free(entries);
+    entries = table;
+    entry_capacity = new_capacity;
+    return 0;
+}
+
+// Get the entry for a path, creating it if needed
+static journal_entry_t *get_entry(const char *path, size_t length) {
+    // Keep the table at most 70% full
+    if ((entry_count + 1) * 10 > entry_capacity * 7 && grow_table() == -1) {
+        return NULL;
+    }
+
+    journal_entry_t *entry = find_slot(entries, entry_capacity, path, length);
+    if (!entry->path) {
+        entry->path = strndup(path, length);
+        if (!entry->path) {
+            perror("Error allocating journal path");
+            return NULL;
+        }
+        entry->offset = 0;
+        entry->temporary = NULL;
+        entry->done = 0;
+        entry_count++;
+    }
+    return entry;
+}
+
+// Take the size and modification time of a source file
+static journal_version_t version_of(const struct stat *source) {
+    journal_version_t version;
+    version.size = (unsigned long long)source->st_size;
+    version.mtime_sec = (unsigned long long)source->st_mtim.tv_sec;
+    version.mtime_nsec = (unsigned long long)source->st_mtim.tv_nsec;
+    return version;
+}
+
+static int same_version(const journal_version_t *a, const journal_version_t *b) {
+    return a->size == b->size && a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec;
+}
+
+// Look up a path without creating it, only if its last record was made against the source as it is now
+static journal_entry_t *lookup(const char *dest_path, const struct stat *source) {
+    if (!entries) {
+        return NULL;
+    }
+    const char *path = relative_path(dest_path);
+    journal_entry_t *entry = find_slot(entries, entry_capacity, path, strlen(path));
+    if (!entry->path) {
+        return NULL;
+    }
+    journal_version_t current = version_of(source);
+    return same_version(&entry->version, &current) ? entry : NULL;
+}
+
+// Parse an unsigned decimal number followed by a space
+static const char *parse_number(const char *ptr, const char *end, unsigned long long *value) {
+    if (ptr == end || *ptr < '0' || *ptr > '9') {
+        return NULL;
+    }
+    *value = 0;
+    while (ptr < end && *ptr >= '0' && *ptr <= '9') {
+        *value = *value * 10 + (unsigned long long)(*ptr - '0');
+        ptr++;
+    }
+    if (ptr == end || *ptr != ' ') {
+        return NULL;
+    }
+    return ptr + 1;
+}
+
+// Apply every complete record of the journal file
+static int replay(int fd) {
+    // Read the whole journal into memory
+    size_t size = 0;
+    size_t capacity = 65536;
+    char *data = malloc(capacity);
+    if (!data) {
+        perror("Error allocating journal buffer");
+        return -1;
+    }
+    for (;;) {
+        if (size == capacity) {
+            char *grown = realloc(data, capacity * 2);
+            if (!grown) {
+                perror("Error allocating journal buffer");
+                free(data);
+                return -1;
+            }
+            data = grown;
+            capacity *= 2;
+        }
+        ssize_t n = read(fd, data + size, capacity - size);
+        if (n == -1) {
+            perror("Error reading journal");
+            free(data);
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        size += n;
+    }
+
+    const char *ptr = data;
+    const char *end = data + size;
+    while (ptr + 2 < end) {
+        char type = ptr[0];
+        const char *cursor = ptr + 2;
+        unsigned long long offset = 0;
+        unsigned long long temporary_length = 0;
+        const char *temporary = NULL;
+        unsigned long long length;
+        journal_version_t version;
+
+        if (ptr[1] != ' ' || (type != 'D' && type != 'P')) {
+            break;
+        }
+        if (type == 'P' && !(cursor = parse_number(cursor, end, &offset))) {
+            break;
+        }
+        if (!(cursor = parse_number(cursor, end, &version.size))
+            || !(cursor = parse_number(cursor, end, &version.mtime_sec))
+            || !(cursor = parse_number(cursor, end, &version.mtime_nsec))) {
+            break;
+        }
+        if (type == 'P') {
+            if (!(cursor = parse_number(cursor, end, &temporary_length))
+                || (size_t)(end - cursor) < temporary_length + 1 || cursor[temporary_length] != ' ') {
+                break;
+            }
+            temporary = cursor;
+            cursor += temporary_length + 1;
+        }
+        if (!(cursor = parse_number(cursor, end, &length))) {
+            break;
+        }
+        // Stop at the first record that was not fully written
+        if ((size_t)(end - cursor) < length + 1 || cursor[length] != '\n') {
+            break;
+        }
+
+        journal_entry_t *entry = get_entry(cursor, length);
+        if (!entry) {
+            free(data);
+            return -1;
+        }
+        if (type == 'D') {
+            // The temporary copy was renamed to the final name
+            free(entry->temporary);
+            entry->temporary = NULL;
+            entry->done = 1;
+        } else {
+            // Progress on another version of the source, or after it was done, starts a new copy
+            if (entry->done || !same_version(&entry->version, &version) || (off_t)offset > entry->offset) {
+                entry->offset = (off_t)offset;
+            }
+            free(entry->temporary);
+            entry->temporary = strndup(temporary, temporary_length);
+            if (!entry->temporary) {
+                perror("Error allocating journal path");
+                free(data);
+                return -1;
+            }
+            entry->done = 0;
+        }
+        entry->version = version;
+        ptr = cursor + length + 1;
+    }
+
+    free(data);
+    return 0;
+}
+
+int journal_default_path(const char *dest_root, char *out, size_t size) {
+    // Resolve the destination so "." and trailing slashes still give a real parent and name
+    char resolved[PATH_MAX];
+    if (!realpath(dest_root, resolved)) {
+        perror("Error resolving destination directory");
+        return -1;
+    }
+
+    char *slash = strrchr(resolved, '/');
+    if (slash == resolved && slash[1] == '\0') {
+        fprintf(stderr, "Error placing journal: %s has no parent directory, use --journal\n", dest_root);
+        return -1;
+    }
+    *slash = '\0';
+
+    int length = snprintf(out, size, "%s/.%s%s", resolved, slash + 1, JOURNAL_SUFFIX);
+    if (length < 0 || (size_t)length >= size) {
+        fprintf(stderr, "Error placing journal: path too long\n");
+        return -1;
+    }
+    return 0;
+}
+
+int journal_open(const char *path, const char *dest_root, int resume) {
+    snprintf(journal_path, sizeof(journal_path), "%s", path);
+    root_length = strlen(dest_root);
+
+    // A fresh copy starts a fresh journal
+    int flags = O_RDWR | O_CREAT | O_APPEND;
+    if (!resume) {
+        flags |= O_TRUNC;
+    }
+    journal_fd = open(journal_path, flags, S_IRUSR | S_IWUSR);
+    if (journal_fd == -1) {
+        perror("Error opening journal");
+        return -1;
+    }
+
+    if (resume && replay(journal_fd) == -1) {
+        close(journal_fd);
+        journal_fd = -1;
+        return -1;
+    }
+
+    // The journal's own directory entry has to survive a crash too, for the default journal this also
+    // covers the destination root's entry
+    char directory_path[PATH_MAX];
+    snprintf(directory_path, sizeof(directory_path), "%s", journal_path);
+    int directory_fd = open(dirname(directory_path), O_RDONLY | O_DIRECTORY);
+    if (directory_fd == -1 || fsync(directory_fd) == -1) {
+        perror("Error syncing journal directory");
+    }
+    if (directory_fd != -1) {
+        close(directory_fd);
+    }
+
+    destination_fd = open(dest_root, O_RDONLY | O_DIRECTORY);
+    if (destination_fd == -1) {
+        perror("Error opening destination for syncing");
+        close(journal_fd);
+        journal_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int journal_is_active(void) {
+    return journal_fd != -1;
+}
+
+int journal_is_done(const char *dest_path, const struct stat *source) {
+    journal_entry_t *entry = lookup(dest_path, source);
+    return entry && entry->done;
+}
+
+off_t journal_resume_offset(const char *dest_path, const struct stat *source, const char **temporary) {
+    *temporary = NULL;
+    if (!entries) {
+        return 0;
+    }
+    const char *path = relative_path(dest_path);
+    journal_entry_t *entry = find_slot(entries, entry_capacity, path, strlen(path));
+    if (!entry->path || entry->done) {
+        return 0;
+    }
+
+    // The temporary copy is named even when it is too old to resume, so it can be removed
+    *temporary = entry->temporary;
+    journal_version_t current = version_of(source);
+    return same_version(&entry->version, &current) ? entry->offset : 0;
+}
+
+// Queue one record for the next commit
+static void queue_record(const char *record, size_t length) {
+    if (pending_length + length > pending_capacity) {
+        size_t new_capacity = pending_capacity ? pending_capacity * 2 : 65536;
+        while (new_capacity < pending_length + length) {
+            new_capacity *= 2;
+        }
+        char *grown = realloc(pending, new_capacity);
+        if (!grown) {
+            // Losing a record only means that file is copied again on resume
+            perror("Error allocating journal record");
+            return;
+        }
+        pending = grown;
+        pending_capacity = new_capacity;
+    }
+    memcpy(pending + pending_length, record, length);
+    pending_length += length;
+}
+
+// Remember the path of a queued record so the commit knows what to sync
+static void queue_path(char type, const char *path) {
+    size_t length = strlen(path) + 2;
+    if (pending_paths_length + length > pending_paths_capacity) {
+        size_t new_capacity = pending_paths_capacity ? pending_paths_capacity * 2 : 65536;
+        while (new_capacity < pending_paths_length + length) {
+            new_capacity *= 2;
+        }
+        char *grown = realloc(pending_paths, new_capacity);
+        if (!grown) {
+            perror("Error allocating journal record");
+            return;
+        }
+        pending_paths = grown;
+        pending_paths_capacity = new_capacity;
+    }
+    pending_paths[pending_paths_length] = type;
+    memcpy(pending_paths + pending_paths_length + 1, path, length - 1);
+    pending_paths_length += length;
+}
+
+// Add a directory to the synced set, returns 0 if it is in there already
+static int mark_synced(const char *path, size_t length) {
+    // Keep the set at most 70% full, a set that cannot grow just lets directories be synced twice
+    if ((synced_count + 1) * 10 > synced_capacity * 7) {
+        size_t new_capacity = synced_capacity ? synced_capacity * 2 : 256;
+        char **table = calloc(new_capacity, sizeof(char *));
+        if (!table) {
+            return 1;
+        }
+        for (size_t i = 0; i < synced_capacity; i++) {
+            if (synced[i]) {
+                size_t index = hash_path(synced[i], strlen(synced[i])) & (new_capacity - 1);
+                while (table[index]) {
+                    index = (index + 1) & (new_capacity - 1);
+                }
+                table[index] = synced[i];
+            }
+        }
+        free(synced);
+        synced = table;
+        synced_capacity = new_capacity;
+    }
+
+    size_t index = hash_path(path, length) & (synced_capacity - 1);
+    while (synced[index]) {
+        if (strlen(synced[index]) == length && memcmp(synced[index], path, length) == 0) {
+            return 0;
+        }
+        index = (index + 1) & (synced_capacity - 1);
+    }
+    synced[index] = strndup(path, length);
+    if (!synced[index]) {
+        return 1;
+    }
+    synced_count++;
+    return 1;
+}
+
+// Forget the directories synced by the last commit
+static void clear_synced(void) {
+    for (size_t i = 0; i < synced_capacity; i++) {
+        free(synced[i]);
+        synced[i] = NULL;
+    }
+    synced_count = 0;
+}
+
+// Sync the directories from the one holding a recorded path up to the destination root, stopping at
+// the first one this commit already synced since everything above it was synced with it
+static void sync_directories(const char *path) {
+    size_t length = strlen(path);
+    for (;;) {
+        // Step back to the parent, the root is the empty path
+        while (length > 0 && path[length - 1] != '/') {
+            length--;
+        }
+        length = length > 0 ? length - 1 : 0;
+        if (!mark_synced(path, length)) {
+            return;
+        }
+
+        int fd;
+        if (length == 0) {
+            fd = dup(destination_fd);
+        } else {
+            char directory[PATH_MAX];
+            memcpy(directory, path, length);
+            directory[length] = '\0';
+            fd = openat(destination_fd, directory, O_RDONLY | O_DIRECTORY);
+        }
+        if (fd == -1 || fsync(fd) == -1) {
+            perror("Error syncing destination directory");
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+        if (length == 0) {
+            return;
+        }
+    }
+}
+
+// Sync the data of a published file, symbolic links have none and are covered by their directory
+static void sync_file(const char *path) {
+    int fd = openat(destination_fd, path, O_RDONLY | O_NOFOLLOW);
+    if (fd == -1) {
+        if (errno != ELOOP) {
+            perror("Error syncing destination file");
+        }
+        return;
+    }
+    if (fdatasync(fd) == -1) {
+        perror("Error syncing destination file");
+    }
+    close(fd);
+}
+
+void journal_commit(void) {
+    if (journal_fd == -1 || pending_length == 0) {
+        return;
+    }
+
+    // The data and the renames behind the records go first
+    for (size_t position = 0; position < pending_paths_length;) {
+        const char *path = pending_paths + position + 1;
+        if (pending_paths[position] == 'D') {
+            sync_file(path);
+        }
+        sync_directories(path);
+        position += strlen(path) + 2;
+    }
+    clear_synced();
+
+    size_t written = 0;
+    while (written < pending_length) {
+        ssize_t n = write(journal_fd, pending + written, pending_length - written);
+        if (n == -1) {
+            perror("Error writing journal");
+            break;
+        }
+        written += n;
+    }
+    if (fsync(journal_fd) == -1) {
+        perror("Error syncing journal");
+    }
+
+    pending_length = 0;
+    pending_paths_length = 0;
+    pending_files = 0;
+    pending_bytes = 0;
+}
+
+void journal_record_done(const char *dest_path, const struct stat *source) {
+    if (journal_fd == -1) {
+        return;
+    }
+
+    const char *path = relative_path(dest_path);
+    journal_version_t version = version_of(source);
+    char record[PATH_MAX + 128];
+    int length = snprintf(record, sizeof(record), "D %llu %llu %llu %zu %s\n",
+                          version.size, version.mtime_sec, version.mtime_nsec, strlen(path), path);
+    if (length > 0 && (size_t)length < sizeof(record)) {
+        queue_record(record, length);
+        queue_path('D', path);
+    }
+
+    pending_files++;
+    pending_bytes += source->st_size;
+    if (pending_files >= JOURNAL_COMMIT_FILES || pending_bytes >= JOURNAL_COMMIT_BYTES) {
+        journal_commit();
+    }
+}
+
+void journal_record_progress(const char *dest_path, const char *temporary, off_t offset, const struct stat *source) {
+    if (journal_fd == -1) {
+        return;
+    }
+
+    const char *path = relative_path(dest_path);
+    journal_version_t version = version_of(source);
+    char record[2 * PATH_MAX + 128];
+    int length = snprintf(record, sizeof(record), "P %lld %llu %llu %llu %zu %s %zu %s\n", (long long)offset,
+                          version.size, version.mtime_sec, version.mtime_nsec,
+                          strlen(temporary), temporary, strlen(path), path);
+    if (length > 0 && (size_t)length < sizeof(record)) {
+        queue_record(record, length);
+        queue_path('P', path);
+    }
+    journal_commit();
+}
+
+void journal_close(int completed) {
+    if (journal_fd == -1) {
+        return;
+    }
+
+    // A finished journal is removed anyway, only an unfinished one is worth syncing
+    if (!completed) {
+        journal_commit();
+    }
+
+    if (close(journal_fd) == -1) {
+        perror("Error closing journal");
+    }
+    journal_fd = -1;
+    close(destination_fd);
+    destination_fd = -1;
+
+    free(pending);
+    pending = NULL;
+    pending_length = 0;
+    pending_capacity = 0;
+    free(pending_paths);
+    pending_paths = NULL;
+    pending_paths_length = 0;
+    pending_paths_capacity = 0;
+    free(synced);
+    synced = NULL;
+    synced_capacity = 0;
+    pending_files = 0;
+    pending_bytes = 0;
+
+    // Nothing is left to resume once the whole tree is copied
+    if (completed && unlink(journal_path) == -1) {
+        perror("Error removing journal");
+    }
+
+    for (size_t i = 0; i < entry_capacity; i++) {
+        free(entries[i].path);
+        free(entries[i].temporary);
+    }
+    free(entries);
+    entries = NULL;
+    entry_capacity = 0;
+    entry_count = 0;
+}
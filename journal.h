@@ -0,0 +1,57 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Suffix of the default journal, kept next to the destination directory as .<name><suffix>.
+// It never lives inside the destination, where a copied file of the same name would replace it.
+#define JOURNAL_SUFFIX ".copytree-journal"
+
+// Amount of data copied into a file between two progress records
+#define JOURNAL_PROGRESS_INTERVAL (64 * 1024 * 1024)
+
+// Records are held back and committed in batches, after this much published data or this many files
+#define JOURNAL_COMMIT_BYTES (64 * 1024 * 1024)
+#define JOURNAL_COMMIT_FILES 4096
+
+// Build the default journal path for a destination directory, returns -1 if it has no parent to hold it
+int journal_default_path(const char *dest_root, char *out, size_t size);
+
+// Start journaling a copy into dest_root at journal_path, replaying the existing journal first when resuming
+int journal_open(const char *journal_path, const char *dest_root, int resume);
+
+// Check whether a journal is open
+int journal_is_active(void);
+
+// Check whether the journal says a destination file was already published from a source that still
+// has the size and modification time in source
+int journal_is_done(const char *dest_path, const struct stat *source);
+
+// Get the offset up to which a destination file's temporary copy was saved, 0 if none or if the
+// source no longer has the size and modification time it had then. temporary is set to the name of
+// that copy in the destination's directory, or NULL if the journal knows of none.
+off_t journal_resume_offset(const char *dest_path, const struct stat *source, const char **temporary);
+
+// Record that a destination file was published from source under its final name, committed with the next batch
+void journal_record_done(const char *dest_path, const struct stat *source);
+
+// Record that the temporary copy of a destination file, named temporary in the same directory, holds
+// valid data of source up to offset, and commit right away
+void journal_record_progress(const char *dest_path, const char *temporary, off_t offset, const struct stat *source);
+
+// Make everything written to the destination so far durable, then the records that describe it
+void journal_commit(void);
+
+// Close the journal, removing it when the copy completed and committing what is left otherwise
+void journal_close(int completed);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // JOURNAL_H
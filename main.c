@@ -1,20 +1,42 @@
 #include "copytree.h"
+#include "telemetry.h"
+#include "journal.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
+#include <getopt.h>
 
 void print_usage(const char *prog_name) {
-    fprintf(stderr, "Usage: %s [-l] [-p] <source_directory> <destination_directory>\n", prog_name);
+    fprintf(stderr, "Usage: %s [-l] [-p] [-c] [-v] [-r report.json] [-o order] [--resume] [--journal path] <source_directory> <destination_directory>\n", prog_name);
     fprintf(stderr, "  -l: Copy symbolic links as links\n");
     fprintf(stderr, "  -p: Copy file permissions\n");
+    fprintf(stderr, "  -c: Copy without filling the page cache (O_DIRECT for large files, drop-behind otherwise)\n");
+    fprintf(stderr, "  -v: Show a progress line with throughput while copying\n");
+    fprintf(stderr, "  -r: Write a JSON telemetry report to the given file when done\n");
+    fprintf(stderr, "  -o: Copy order after scanning the tree: size (largest first, default), readdir, inode or extent\n");
+    fprintf(stderr, "  --resume: Continue an interrupted copy from its checkpoint journal\n");
+    fprintf(stderr, "  --journal: Keep the checkpoint journal at this path, outside the destination (default .<destination>%s next to it)\n", JOURNAL_SUFFIX);
 }
 
 int main(int argc, char *argv[]) {
     int opt;
     int copy_symlinks = 0;
     int copy_permissions = 0;
+    int cache_neutral = 0;
+    int show_progress = 0;
+    const char *report_path = NULL;
+    copy_order_t order = COPY_ORDER_SIZE;
+    int resume = 0;
+    const char *journal_path = NULL;
 
-    while ((opt = getopt(argc, argv, "lp")) != -1) {
+    static const struct option long_options[] = {
+        {"resume", no_argument, NULL, 'R'},
+        {"journal", required_argument, NULL, 'J'},
+        {NULL, 0, NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "lpcvr:o:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'l':
                 copy_symlinks = 1;
@@ -22,6 +44,28 @@ int main(int argc, char *argv[]) {
             case 'p':
                 copy_permissions = 1;
                 break;
+            case 'c':
+                cache_neutral = 1;
+                break;
+            case 'v':
+                show_progress = 1;
+                break;
+            case 'r':
+                report_path = optarg;
+                break;
+            case 'R':
+                resume = 1;
+                break;
+            case 'J':
+                journal_path = optarg;
+                break;
+            case 'o':
+                if (parse_copy_order(optarg, &order) == -1) {
+                    fprintf(stderr, "Unknown copy order: %s\n", optarg);
+                    print_usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
             default:
                 print_usage(argv[0]);
                 return EXIT_FAILURE;
@@ -36,7 +80,40 @@ int main(int argc, char *argv[]) {
     const char *src_dir = argv[optind];
     const char *dest_dir = argv[optind + 1];
 
+    set_copy_order(order);
+    set_cache_neutral(cache_neutral);
+
+    // Only pay for the counters when someone is going to look at them
+    if (show_progress || report_path) {
+        telemetry_enable(show_progress);
+    }
+
+    // The default journal is placed next to the resolved destination, so that has to exist first
+    create_directories(dest_dir);
+    // A journal that was asked for has to work, the default one only makes a later --resume possible
+    int journal_required = resume || journal_path != NULL;
+    char default_journal[PATH_MAX];
+    int journal_placed = 1;
+    if (!journal_path) {
+        journal_placed = journal_default_path(dest_dir, default_journal, sizeof(default_journal)) == 0;
+        journal_path = default_journal;
+    }
+    if (!journal_placed || journal_open(journal_path, dest_dir, resume) == -1) {
+        if (journal_required) {
+            return EXIT_FAILURE;
+        }
+        fprintf(stderr, "Warning: copying without a journal, an interrupted copy cannot be resumed\n");
+    }
+
     copy_directory(src_dir, dest_dir, copy_symlinks, copy_permissions);
 
+    // Keep the journal around while there is something left to retry
+    journal_close(copy_errors() == 0);
+
+    telemetry_finish();
+    if (report_path && telemetry_write_json(report_path) == -1) {
+        return EXIT_FAILURE;
+    }
+
     return 0;
 }
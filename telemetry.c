@@ -0,0 +1,306 @@
+#include "telemetry.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// Counters owned by a single thread. Only the owner writes them, other threads only read,
+// so every update is a relaxed load and store instead of a locked read-modify-write.
+typedef struct telemetry_slot {
+    _Atomic uint64_t entries_scanned;
+    _Atomic uint64_t files_copied;
+    _Atomic uint64_t bytes_copied;
+    _Atomic uint64_t errors;
+
+    _Atomic uint64_t calls[TELEMETRY_CLASS_COUNT];
+    _Atomic uint64_t total_ns[TELEMETRY_CLASS_COUNT];
+    _Atomic uint64_t histogram[TELEMETRY_CLASS_COUNT][TELEMETRY_BUCKETS];
+
+    struct telemetry_slot *next;    // Next slot in the global list, set once before publishing
+} telemetry_slot_t;
+
+// Names used for the syscall classes in the JSON report
+static const char *class_names[TELEMETRY_CLASS_COUNT] = {
+    "stat", "open", "read", "write", "chmod"
+};
+
+static atomic_int enabled;
+static atomic_int show_progress;
+
+// Head of the list of all thread slots, slots are pushed and never removed
+static _Atomic(telemetry_slot_t *) slots;
+
+// Slot of the calling thread, created on its first update
+static _Thread_local telemetry_slot_t *local_slot;
+
+static uint64_t start_ns;
+static _Atomic uint64_t next_progress_ns;
+static _Atomic uint64_t total_files;
+static _Atomic uint64_t total_bytes;
+
+// Read the monotonic clock in nanoseconds
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Get the calling thread's slot, registering a new one on first use
+static telemetry_slot_t *get_slot(void) {
+    if (local_slot) {
+        return local_slot;
+    }
+
+    telemetry_slot_t *slot = calloc(1, sizeof(telemetry_slot_t));
+    if (!slot) {
+        return NULL;
+    }
+
+    // Push the slot onto the global list
+    telemetry_slot_t *head = atomic_load_explicit(&slots, memory_order_relaxed);
+    do {
+        slot->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&slots, &head, slot,
+                                                    memory_order_release, memory_order_relaxed));
+
+    local_slot = slot;
+    return slot;
+}
+
+// Add to a counter that only the calling thread writes
+static inline void slot_add(_Atomic uint64_t *counter, uint64_t value) {
+    uint64_t current = atomic_load_explicit(counter, memory_order_relaxed);
+    atomic_store_explicit(counter, current + value, memory_order_relaxed);
+}
+
+// Find the histogram bucket for a duration
+static int bucket_for(uint64_t ns) {
+    int bucket = 0;
+    while (ns > 1 && bucket < TELEMETRY_BUCKETS - 1) {
+        ns >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+// Format a byte count with a binary unit
+static void format_bytes(char *out, size_t size, double bytes) {
+    const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    int unit = 0;
+    while (bytes >= 1024.0 && unit < 4) {
+        bytes /= 1024.0;
+        unit++;
+    }
+    snprintf(out, size, "%.1f %s", bytes, units[unit]);
+}
+
+void telemetry_enable(int progress) {
+    start_ns = now_ns();
+    atomic_store(&next_progress_ns, start_ns + TELEMETRY_PROGRESS_INTERVAL_NS);
+    atomic_store(&show_progress, progress);
+    atomic_store(&enabled, 1);
+}
+
+int telemetry_enabled(void) {
+    return atomic_load_explicit(&enabled, memory_order_relaxed);
+}
+
+void telemetry_set_totals(uint64_t files, uint64_t bytes) {
+    atomic_store_explicit(&total_files, files, memory_order_relaxed);
+    atomic_store_explicit(&total_bytes, bytes, memory_order_relaxed);
+
+    // Announce the amount of work once it is known
+    if (telemetry_enabled() && atomic_load_explicit(&show_progress, memory_order_relaxed)) {
+        char size[32];
+        format_bytes(size, sizeof(size), (double)bytes);
+        fprintf(stderr, "\rTo copy: %llu files, %s\n", (unsigned long long)files, size);
+    }
+}
+
+uint64_t telemetry_begin(void) {
+    if (!telemetry_enabled()) {
+        return 0;
+    }
+    return now_ns();
+}
+
+void telemetry_end(telemetry_class_t cls, uint64_t start) {
+    if (start == 0) {
+        return;
+    }
+
+    telemetry_slot_t *slot = get_slot();
+    if (!slot) {
+        return;
+    }
+
+    uint64_t elapsed = now_ns() - start;
+    slot_add(&slot->calls[cls], 1);
+    slot_add(&slot->total_ns[cls], elapsed);
+    slot_add(&slot->histogram[cls][bucket_for(elapsed)], 1);
+}
+
+void telemetry_add_entry(void) {
+    telemetry_slot_t *slot;
+    if (telemetry_enabled() && (slot = get_slot())) {
+        slot_add(&slot->entries_scanned, 1);
+    }
+}
+
+void telemetry_add_file(void) {
+    telemetry_slot_t *slot;
+    if (telemetry_enabled() && (slot = get_slot())) {
+        slot_add(&slot->files_copied, 1);
+    }
+}
+
+void telemetry_add_bytes(uint64_t bytes) {
+    telemetry_slot_t *slot;
+    if (telemetry_enabled() && (slot = get_slot())) {
+        slot_add(&slot->bytes_copied, bytes);
+    }
+}
+
+void telemetry_add_error(void) {
+    telemetry_slot_t *slot;
+    if (telemetry_enabled() && (slot = get_slot())) {
+        slot_add(&slot->errors, 1);
+    }
+}
+
+void telemetry_snapshot(telemetry_snapshot_t *out) {
+    memset(out, 0, sizeof(*out));
+
+    // Walk every slot and sum what it holds right now
+    for (telemetry_slot_t *slot = atomic_load_explicit(&slots, memory_order_acquire);
+         slot; slot = slot->next) {
+        out->entries_scanned += atomic_load_explicit(&slot->entries_scanned, memory_order_relaxed);
+        out->files_copied += atomic_load_explicit(&slot->files_copied, memory_order_relaxed);
+        out->bytes_copied += atomic_load_explicit(&slot->bytes_copied, memory_order_relaxed);
+        out->errors += atomic_load_explicit(&slot->errors, memory_order_relaxed);
+
+        for (int cls = 0; cls < TELEMETRY_CLASS_COUNT; cls++) {
+            out->calls[cls] += atomic_load_explicit(&slot->calls[cls], memory_order_relaxed);
+            out->total_ns[cls] += atomic_load_explicit(&slot->total_ns[cls], memory_order_relaxed);
+            for (int bucket = 0; bucket < TELEMETRY_BUCKETS; bucket++) {
+                out->histogram[cls][bucket] +=
+                    atomic_load_explicit(&slot->histogram[cls][bucket], memory_order_relaxed);
+            }
+        }
+    }
+}
+
+// Print one progress line, overwriting the previous one
+static void print_progress(uint64_t now) {
+    telemetry_snapshot_t snap;
+    telemetry_snapshot(&snap);
+
+    double elapsed = (double)(now - start_ns) / 1e9;
+    double rate = elapsed > 0 ? (double)snap.bytes_copied / elapsed : 0;
+
+    char copied[32];
+    char throughput[32];
+    format_bytes(copied, sizeof(copied), (double)snap.bytes_copied);
+    format_bytes(throughput, sizeof(throughput), rate);
+
+    // The ETA is only known once someone has told us how much work there is
+    char eta[32] = "--:--";
+    uint64_t expected = atomic_load_explicit(&total_bytes, memory_order_relaxed);
+    if (expected > 0 && rate > 0) {
+        uint64_t left = expected > snap.bytes_copied ? expected - snap.bytes_copied : 0;
+        uint64_t seconds = (uint64_t)((double)left / rate);
+        snprintf(eta, sizeof(eta), "%02llu:%02llu",
+                 (unsigned long long)(seconds / 60), (unsigned long long)(seconds % 60));
+    }
+
+    char files[48];
+    uint64_t expected_files = atomic_load_explicit(&total_files, memory_order_relaxed);
+    if (expected_files > 0) {
+        snprintf(files, sizeof(files), "%llu/%llu files",
+                 (unsigned long long)snap.files_copied, (unsigned long long)expected_files);
+    } else {
+        snprintf(files, sizeof(files), "%llu files", (unsigned long long)snap.files_copied);
+    }
+
+    fprintf(stderr, "\r%llu entries, %s, %s copied, %s/s, %llu errors, ETA %s   ",
+            (unsigned long long)snap.entries_scanned, files, copied, throughput,
+            (unsigned long long)snap.errors, eta);
+    fflush(stderr);
+}
+
+void telemetry_progress(void) {
+    if (!telemetry_enabled() || !atomic_load_explicit(&show_progress, memory_order_relaxed)) {
+        return;
+    }
+
+    uint64_t now = now_ns();
+    uint64_t due = atomic_load_explicit(&next_progress_ns, memory_order_relaxed);
+    if (now < due) {
+        return;
+    }
+
+    // Only the thread that moves the deadline forward prints
+    if (atomic_compare_exchange_strong_explicit(&next_progress_ns, &due,
+                                                now + TELEMETRY_PROGRESS_INTERVAL_NS,
+                                                memory_order_relaxed, memory_order_relaxed)) {
+        print_progress(now);
+    }
+}
+
+void telemetry_finish(void) {
+    if (!telemetry_enabled() || !atomic_load_explicit(&show_progress, memory_order_relaxed)) {
+        return;
+    }
+    print_progress(now_ns());
+    fputc('\n', stderr);
+}
+
+int telemetry_write_json(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        perror("Error opening telemetry report");
+        return -1;
+    }
+
+    telemetry_snapshot_t snap;
+    telemetry_snapshot(&snap);
+    double elapsed = (double)(now_ns() - start_ns) / 1e9;
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"elapsed_seconds\": %.6f,\n", elapsed);
+    fprintf(file, "  \"entries_scanned\": %llu,\n", (unsigned long long)snap.entries_scanned);
+    fprintf(file, "  \"files_copied\": %llu,\n", (unsigned long long)snap.files_copied);
+    fprintf(file, "  \"bytes_copied\": %llu,\n", (unsigned long long)snap.bytes_copied);
+    fprintf(file, "  \"errors\": %llu,\n", (unsigned long long)snap.errors);
+    fprintf(file, "  \"total_files\": %llu,\n", (unsigned long long)atomic_load(&total_files));
+    fprintf(file, "  \"total_bytes\": %llu,\n", (unsigned long long)atomic_load(&total_bytes));
+    fprintf(file, "  \"bytes_per_second\": %.1f,\n", elapsed > 0 ? (double)snap.bytes_copied / elapsed : 0.0);
+    fprintf(file, "  \"syscalls\": {\n");
+
+    for (int cls = 0; cls < TELEMETRY_CLASS_COUNT; cls++) {
+        fprintf(file, "    \"%s\": {\"calls\": %llu, \"total_ns\": %llu, \"histogram_log2_ns\": [",
+                class_names[cls], (unsigned long long)snap.calls[cls],
+                (unsigned long long)snap.total_ns[cls]);
+
+        // Leave out the empty buckets at the top of the range
+        int last = TELEMETRY_BUCKETS - 1;
+        while (last > 0 && snap.histogram[cls][last] == 0) {
+            last--;
+        }
+        for (int bucket = 0; bucket <= last; bucket++) {
+            fprintf(file, "%s%llu", bucket ? ", " : "", (unsigned long long)snap.histogram[cls][bucket]);
+        }
+
+        fprintf(file, "]}%s\n", cls + 1 < TELEMETRY_CLASS_COUNT ? "," : "");
+    }
+
+    fprintf(file, "  }\n");
+    fprintf(file, "}\n");
+
+    if (fclose(file) == EOF) {
+        perror("Error closing telemetry report");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,75 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Syscall classes that get their own latency histogram
+typedef enum {
+    TELEMETRY_STAT,
+    TELEMETRY_OPEN,
+    TELEMETRY_READ,
+    TELEMETRY_WRITE,
+    TELEMETRY_CHMOD,
+    TELEMETRY_CLASS_COUNT
+} telemetry_class_t;
+
+// Number of latency buckets, bucket i counts calls that took [2^i, 2^(i+1)) nanoseconds
+#define TELEMETRY_BUCKETS 40
+
+// Minimum time between two progress lines, in nanoseconds
+#define TELEMETRY_PROGRESS_INTERVAL_NS 1000000000ULL
+
+// Counters summed over every thread that reported anything
+typedef struct {
+    uint64_t entries_scanned;   // Directory entries looked at
+    uint64_t files_copied;      // Regular files and symlinks fully copied
+    uint64_t bytes_copied;      // Bytes written to destination files
+    uint64_t errors;            // Failed operations that were reported and skipped
+
+    uint64_t calls[TELEMETRY_CLASS_COUNT];                          // Number of timed calls per class
+    uint64_t total_ns[TELEMETRY_CLASS_COUNT];                       // Time spent per class
+    uint64_t histogram[TELEMETRY_CLASS_COUNT][TELEMETRY_BUCKETS];   // Latency distribution per class
+} telemetry_snapshot_t;
+
+// Turn counting on, optionally with a periodic progress line on stderr
+void telemetry_enable(int show_progress);
+
+// Check whether counting is on
+int telemetry_enabled(void);
+
+// Set the expected amount of work so the progress line can show an ETA
+void telemetry_set_totals(uint64_t total_files, uint64_t total_bytes);
+
+// Start timing a syscall, returns 0 when telemetry is disabled
+uint64_t telemetry_begin(void);
+
+// Stop timing a syscall started with telemetry_begin and record it under the given class
+void telemetry_end(telemetry_class_t cls, uint64_t start);
+
+// Per-thread counter updates
+void telemetry_add_entry(void);
+void telemetry_add_file(void);
+void telemetry_add_bytes(uint64_t bytes);
+void telemetry_add_error(void);
+
+// Sum the counters of all threads without stopping them
+void telemetry_snapshot(telemetry_snapshot_t *out);
+
+// Print the progress line if the progress interval has passed since the last one
+void telemetry_progress(void);
+
+// Print the final progress line and end it with a newline
+void telemetry_finish(void);
+
+// Dump the aggregated counters and histograms as JSON
+int telemetry_write_json(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TELEMETRY_H
@@ -0,0 +1,208 @@
+#include "tree_index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// Running out of memory while indexing leaves nothing sensible to copy, so allocation failures exit
+static void allocation_failed(const char *message) {
+    perror(message);
+    exit(EXIT_FAILURE);
+}
+
+// Take size bytes from the arena, starting a new chunk when the current one is full
+static void *arena_alloc(tree_index_t *index, size_t size, size_t alignment) {
+    tree_index_chunk_t *chunk = index->chunks;
+    if (chunk) {
+        size_t start = (chunk->used + alignment - 1) & ~(alignment - 1);
+        if (start + size <= chunk->size) {
+            chunk->used = start + size;
+            return chunk->data + start;
+        }
+    }
+
+    // Oversized requests get a chunk of their own
+    size_t chunk_size = size + alignment > TREE_INDEX_CHUNK_SIZE ? size + alignment : TREE_INDEX_CHUNK_SIZE;
+    chunk = malloc(sizeof(tree_index_chunk_t) + chunk_size);
+    if (!chunk) {
+        allocation_failed("Error allocating tree index arena");
+    }
+    chunk->size = chunk_size;
+    chunk->next = index->chunks;
+    index->chunks = chunk;
+
+    size_t start = ((uintptr_t)chunk->data + alignment - 1) / alignment * alignment - (uintptr_t)chunk->data;
+    chunk->used = start + size;
+    return chunk->data + start;
+}
+
+// FNV-1a hash of a name
+static size_t hash_name(const char *name) {
+    size_t hash = 14695981039346656037ULL;
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Double the interning table and rehash every name
+static void grow_name_table(tree_index_t *index) {
+    size_t new_size = index->name_table_size ? index->name_table_size * 2 : 4096;
+    uint32_t *table = calloc(new_size, sizeof(uint32_t));
+    if (!table) {
+        allocation_failed("Error allocating tree index name table");
+    }
+
+    for (uint32_t id = 0; id < index->name_count; id++) {
+        size_t slot = hash_name(index->names[id]) & (new_size - 1);
+        while (table[slot]) {
+            slot = (slot + 1) & (new_size - 1);
+        }
+        table[slot] = id + 1;
+    }
+
+    free(index->name_table);
+    index->name_table = table;
+    index->name_table_size = new_size;
+}
+
+// Get the id of a name, storing it once in the arena the first time it is seen
+static uint32_t intern_name(tree_index_t *index, const char *name) {
+    // Keep the table at most half full
+    if ((size_t)(index->name_count + 1) * 2 > index->name_table_size) {
+        grow_name_table(index);
+    }
+
+    size_t slot = hash_name(name) & (index->name_table_size - 1);
+    while (index->name_table[slot]) {
+        uint32_t id = index->name_table[slot] - 1;
+        if (strcmp(index->names[id], name) == 0) {
+            return id;
+        }
+        slot = (slot + 1) & (index->name_table_size - 1);
+    }
+
+    if (index->name_count == index->name_capacity) {
+        uint32_t new_capacity = index->name_capacity ? index->name_capacity * 2 : 1024;
+        const char **names = realloc(index->names, new_capacity * sizeof(char *));
+        if (!names) {
+            allocation_failed("Error allocating tree index names");
+        }
+        index->names = names;
+        index->name_capacity = new_capacity;
+    }
+
+    size_t length = strlen(name) + 1;
+    char *copy = arena_alloc(index, length, 1);
+    memcpy(copy, name, length);
+
+    uint32_t id = index->name_count++;
+    index->names[id] = copy;
+    index->name_table[slot] = id + 1;
+    return id;
+}
+
+tree_index_t *tree_index_create(void) {
+    tree_index_t *index = calloc(1, sizeof(tree_index_t));
+    if (!index) {
+        allocation_failed("Error allocating tree index");
+    }
+    return index;
+}
+
+void tree_index_destroy(tree_index_t *index) {
+    if (!index) {
+        return;
+    }
+
+    tree_index_chunk_t *chunk = index->chunks;
+    while (chunk) {
+        tree_index_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(index->pages);
+    free(index->names);
+    free(index->name_table);
+    free(index);
+}
+
+uint32_t tree_index_add(tree_index_t *index, uint32_t parent, const char *name,
+                        mode_t mode, uint64_t size, uint64_t ino) {
+    if (index->count == TREE_INDEX_ROOT) {
+        fprintf(stderr, "Error adding to tree index: too many entries\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t entry = index->count;
+    size_t page_number = entry / TREE_INDEX_PAGE_ENTRIES;
+    size_t slot = entry % TREE_INDEX_PAGE_ENTRIES;
+
+    // Start a new page when the last one is full
+    if (slot == 0) {
+        if (page_number == index->page_capacity) {
+            size_t new_capacity = index->page_capacity ? index->page_capacity * 2 : 16;
+            tree_index_page_t **pages = realloc(index->pages, new_capacity * sizeof(tree_index_page_t *));
+            if (!pages) {
+                allocation_failed("Error allocating tree index pages");
+            }
+            index->pages = pages;
+            index->page_capacity = new_capacity;
+        }
+        index->pages[page_number] = arena_alloc(index, sizeof(tree_index_page_t), sizeof(uint64_t));
+    }
+
+    tree_index_page_t *page = index->pages[page_number];
+    page->parent[slot] = parent;
+    page->name[slot] = intern_name(index, name);
+    page->mode[slot] = (uint32_t)mode;
+    page->size[slot] = size;
+    page->ino[slot] = ino;
+    index->count++;
+
+    if (S_ISDIR(mode)) {
+        index->directory_count++;
+    } else {
+        index->file_count++;
+        if (S_ISREG(mode)) {
+            index->total_bytes += size;
+        }
+    }
+    return entry;
+}
+
+size_t tree_index_path(const tree_index_t *index, uint32_t entry, const char *root, char *buf, size_t size) {
+    // Measure the path first, walking from the entry up to the root
+    size_t length = strlen(root);
+    for (uint32_t current = entry; current != TREE_INDEX_ROOT; current = tree_index_parent(index, current)) {
+        length += 1 + strlen(tree_index_name(index, current));
+    }
+    if (length + 1 > size) {
+        return 0;
+    }
+
+    // Then fill it in from the end
+    buf[length] = '\0';
+    size_t end = length;
+    for (uint32_t current = entry; current != TREE_INDEX_ROOT; current = tree_index_parent(index, current)) {
+        const char *name = tree_index_name(index, current);
+        size_t name_length = strlen(name);
+        end -= name_length;
+        memcpy(buf + end, name, name_length);
+        buf[--end] = '/';
+    }
+    memcpy(buf, root, end);
+    return length;
+}
+
+size_t tree_index_memory(const tree_index_t *index) {
+    size_t total = sizeof(tree_index_t);
+    for (tree_index_chunk_t *chunk = index->chunks; chunk; chunk = chunk->next) {
+        total += sizeof(tree_index_chunk_t) + chunk->size;
+    }
+    total += index->page_capacity * sizeof(tree_index_page_t *);
+    total += index->name_capacity * sizeof(char *);
+    total += index->name_table_size * sizeof(uint32_t);
+    return total;
+}
@@ -0,0 +1,102 @@
+#ifndef TREE_INDEX_H
+#define TREE_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Parent of the entries directly inside the scanned root
+#define TREE_INDEX_ROOT UINT32_MAX
+
+// Entries per page, every column of a page is one contiguous array
+#define TREE_INDEX_PAGE_ENTRIES 65536
+
+// Size of the arena chunks that hold pages and names
+#define TREE_INDEX_CHUNK_SIZE (16 * 1024 * 1024)
+
+// One page of entries stored column by column, 28 bytes per entry
+typedef struct {
+    uint32_t parent[TREE_INDEX_PAGE_ENTRIES];   // Index of the containing directory
+    uint32_t name[TREE_INDEX_PAGE_ENTRIES];     // Interned name id
+    uint32_t mode[TREE_INDEX_PAGE_ENTRIES];     // File type and permissions
+    uint64_t size[TREE_INDEX_PAGE_ENTRIES];     // Size in bytes
+    uint64_t ino[TREE_INDEX_PAGE_ENTRIES];      // Inode number
+} tree_index_page_t;
+
+// A chunk of the bump allocator
+typedef struct tree_index_chunk {
+    struct tree_index_chunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+} tree_index_chunk_t;
+
+// Compact index of a whole directory tree. Directories always come before their contents.
+typedef struct {
+    tree_index_chunk_t *chunks;     // Arena chunks, newest first
+
+    tree_index_page_t **pages;      // Entry pages
+    size_t page_capacity;
+    uint32_t count;                 // Number of entries
+
+    const char **names;             // Interned names by id, the strings live in the arena
+    uint32_t name_count;
+    uint32_t name_capacity;
+    uint32_t *name_table;           // Open-addressing table of name ids plus one, 0 for an empty slot
+    size_t name_table_size;
+
+    uint64_t total_bytes;           // Sum of the sizes of all regular files
+    uint32_t file_count;            // Number of entries that are not directories
+    uint32_t directory_count;       // Number of directories
+} tree_index_t;
+
+// Create an empty index
+tree_index_t *tree_index_create(void);
+
+// Free an index and everything it holds
+void tree_index_destroy(tree_index_t *index);
+
+// Add an entry under parent (TREE_INDEX_ROOT for the top level), returns its index
+uint32_t tree_index_add(tree_index_t *index, uint32_t parent, const char *name,
+                        mode_t mode, uint64_t size, uint64_t ino);
+
+// Write root/<path of entry> into buf, returns the length or 0 if it does not fit
+size_t tree_index_path(const tree_index_t *index, uint32_t entry, const char *root, char *buf, size_t size);
+
+// Get the number of bytes the index holds on to
+size_t tree_index_memory(const tree_index_t *index);
+
+// Column accessors
+static inline tree_index_page_t *tree_index_page(const tree_index_t *index, uint32_t entry) {
+    return index->pages[entry / TREE_INDEX_PAGE_ENTRIES];
+}
+
+static inline uint32_t tree_index_parent(const tree_index_t *index, uint32_t entry) {
+    return tree_index_page(index, entry)->parent[entry % TREE_INDEX_PAGE_ENTRIES];
+}
+
+static inline const char *tree_index_name(const tree_index_t *index, uint32_t entry) {
+    return index->names[tree_index_page(index, entry)->name[entry % TREE_INDEX_PAGE_ENTRIES]];
+}
+
+static inline mode_t tree_index_mode(const tree_index_t *index, uint32_t entry) {
+    return (mode_t)tree_index_page(index, entry)->mode[entry % TREE_INDEX_PAGE_ENTRIES];
+}
+
+static inline uint64_t tree_index_size(const tree_index_t *index, uint32_t entry) {
+    return tree_index_page(index, entry)->size[entry % TREE_INDEX_PAGE_ENTRIES];
+}
+
+static inline uint64_t tree_index_ino(const tree_index_t *index, uint32_t entry) {
+    return tree_index_page(index, entry)->ino[entry % TREE_INDEX_PAGE_ENTRIES];
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TREE_INDEX_H